@@ -11,6 +11,7 @@
 
 #include <linux/mm.h>
 #include <linux/fs.h>
+#include <linux/idr.h>
 #include <linux/init.h>
 #include <linux/list.h>
 #include <linux/cdev.h>
@@ -19,20 +20,197 @@
 #include <linux/sched.h>
 #include <linux/ioctl.h>
 #include <linux/types.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+#include <linux/hrtimer.h>
+#include <linux/device.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/mmzone.h>
 #include <linux/vmalloc.h>
 #include <linux/spinlock.h>
+#include <linux/timekeeping.h>
 
 #include "lunix.h"
 #include "lunix-chrdev.h"
 #include "lunix-lookup.h"
+#include "lunix-protocol.h"
 
 /*
  * Global data
  */
 struct cdev lunix_chrdev_cdev;
+static struct class *lunix_chrdev_class;
+
+/*
+ * Converts a raw measurement beyond the ADC full scale, which the lookup
+ * tables do not cover, the same way mk_lookup_tables would have
+ */
+static long lunix_chrdev_convert_slow(enum lunix_msr_enum type, uint16_t raw){
+	switch (type) {
+	case BATT:
+		/* 1.223 * (1023.0 / raw), in thousandths */
+		return 1251129 / raw;
+	case TEMP:
+		/* The thermistor formula is meaningless here */
+		return -272150;
+	case LIGHT:
+		/* Does not fit in 32 bits beyond the ADC full scale */
+		return div_u64((uint64_t)raw * 5000000, 65535);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Converts a raw measurement to its actual value, in thousandths
+ */
+static long lunix_chrdev_convert(enum lunix_msr_enum type, uint16_t raw){
+	static const int32_t *lookup[N_LUNIX_MSR] = {
+		[BATT] = lookup_voltage,
+		[TEMP] = lookup_temperature,
+		[LIGHT] = lookup_light
+	};
+
+	if (likely(raw < LUNIX_LOOKUP_SIZE))
+		return lookup[type][raw];
+	return lunix_chrdev_convert_slow(type, raw);
+}
+
+/*
+ * Fills in a binary record for one measurement of a sample
+ */
+static void lunix_chrdev_fill_record(struct lunix_chrdev_record *rec,
+	enum lunix_msr_enum type, const struct lunix_sample_struct *smp){
+	rec->timestamp = smp->timestamp;
+	rec->seq = smp->seq;
+	rec->sensor = smp->sensor;
+	rec->type = type;
+	rec->raw = smp->values[type];
+	rec->reserved = 0;
+	rec->value = lunix_chrdev_convert(type, rec->raw);
+}
+
+/*
+ * Change filter: tells whether a measurement is worth reporting,
+ * compared to the last one reported through this file
+ */
+static int lunix_chrdev_filter_pass(struct lunix_chrdev_state_struct *state,
+	long value, uint64_t timestamp){
+	unsigned long band;
+
+	if (!state->flt_valid)
+		return 1;
+	if (timestamp - state->flt_time < (uint64_t)state->flt_interval_ms * NSEC_PER_MSEC)
+		return 0;
+
+	band = state->flt_deadband;
+	if (state->flt_mode == LUNIX_FILTER_PERCENT)
+		band = abs(state->flt_value) * band / 100;
+	return abs(value - state->flt_value) >= band;
+}
+
+static inline int lunix_chrdev_filter_active(struct lunix_chrdev_state_struct *state){
+	return state->flt_deadband || state->flt_interval_ms;
+}
+
+static void lunix_chrdev_filter_report(struct lunix_chrdev_state_struct *state,
+	long value, uint64_t timestamp){
+	state->flt_value = value;
+	state->flt_time = timestamp;
+	state->flt_valid = 1;
+}
+
+/*
+ * Binary mode readers check the samples against the change filter as they
+ * read them. Sleepers rely on the verdict of the subscriber callback instead,
+ * which sees every sample once: flt_hit is the history position just past
+ * the last one it let through.
+ * Once the filter has changed, the verdicts on the unread samples are
+ * stale, so the next read() has to go through them all over.
+ */
+static void lunix_chrdev_filter_recheck(struct lunix_chrdev_state_struct *state){
+	WRITE_ONCE(state->flt_hit, state->hist_pos + 1);
+}
+
+#define LUNIX_CHRDEV_RECORD_BATCH	8
+
+/*
+ * Window mode. The subscriber callback adds every sample to the current
+ * window, readers pick up the last complete one, both holding win_lock.
+ */
+static inline uint64_t lunix_chrdev_window_ns(struct lunix_chrdev_state_struct *state){
+	return (uint64_t)state->win_ms * NSEC_PER_MSEC;
+}
+
+static void lunix_chrdev_window_reset(struct lunix_chrdev_state_struct *state){
+	state->win_cur.count = 0;
+	state->win_ready = 0;
+	state->win_lost = 0;
+}
+
+/* Completes the current window, if it has ended by now */
+static int lunix_chrdev_window_close(struct lunix_chrdev_state_struct *state, uint64_t now){
+	struct lunix_chrdev_window_struct *cur = &state->win_cur;
+
+	if (!cur->count || now - cur->start < lunix_chrdev_window_ns(state))
+		return 0;
+	if (state->win_ready)
+		state->win_lost++;
+	state->win_done = *cur;
+	state->win_ready = 1;
+	cur->count = 0;
+	return 1;
+}
+
+/* Fires at the end of the current window, even if the sensor has gone quiet */
+static enum hrtimer_restart lunix_chrdev_window_timer(struct hrtimer *timer){
+	struct lunix_chrdev_state_struct *state;
+	unsigned long flags;
+	int closed;
+
+	state = container_of(timer, struct lunix_chrdev_state_struct, win_timer);
+	spin_lock_irqsave(&state->win_lock, flags);
+	closed = lunix_chrdev_window_close(state, ktime_get_ns());
+	spin_unlock_irqrestore(&state->win_lock, flags);
+
+	if (closed)
+		wake_up_interruptible(&state->wq);
+	return HRTIMER_NORESTART;
+}
+
+/* Returns whether a window was completed, so that readers get woken up */
+static int lunix_chrdev_window_add(struct lunix_chrdev_state_struct *state,
+	const struct lunix_sample_struct *smp){
+	struct lunix_chrdev_window_struct *cur = &state->win_cur;
+	long value = lunix_chrdev_convert(state->type, smp->values[state->type]);
+	unsigned long flags;
+	uint64_t rem;
+	int closed = 0;
+
+	/* The window timer takes it in interrupt context */
+	spin_lock_irqsave(&state->win_lock, flags);
+	/* The mode may have changed since the caller looked at it */
+	if (state->mode != LUNIX_CHRDEV_MODE_WINDOW)
+		goto out;
+
+	closed = lunix_chrdev_window_close(state, smp->timestamp);
+	if (!cur->count) {
+		div64_u64_rem(smp->timestamp, lunix_chrdev_window_ns(state), &rem);
+		cur->start = smp->timestamp - rem;
+		cur->sum = 0;
+		cur->min = cur->max = value;
+		hrtimer_start(&state->win_timer,
+			ns_to_ktime(cur->start + lunix_chrdev_window_ns(state)), HRTIMER_MODE_ABS);
+	}
+	cur->count++;
+	cur->sum += value;
+	cur->min = min(cur->min, value);
+	cur->max = max(cur->max, value);
+out:
+	spin_unlock_irqrestore(&state->win_lock, flags);
+	return closed;
+}
 
 /*
  * Just a quick [unlocked] check to see if the cached
@@ -40,15 +218,104 @@ struct cdev lunix_chrdev_cdev;
  */
 static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *state){
 	struct lunix_sensor_struct *sensor;
+	struct lunix_msr_data_struct *msr;
+	uint32_t version;
+	uint16_t raw;
+	uint64_t timestamp;
 
 	WARN_ON ( !(sensor = state->sensor));
-	if(sensor->msr_data[state->type]->last_update > state->buf_timestamp) {
-    //debug("@ NEEDS_REFRESH: returning 1, wake up!\n");
-    return 1; // => wake up
-  }
-	/* The following return is bogus, just for the stub to compile */
-	debug("@ N_R: return 0\n");
-	return 0;// => no new data, keep sleeping
+	if (state->mode == LUNIX_CHRDEV_MODE_WINDOW)
+		return READ_ONCE(state->win_ready) ||
+			(READ_ONCE(state->win_cur.count) &&
+			 ktime_get_ns() - READ_ONCE(state->win_cur.start) >= lunix_chrdev_window_ns(state));
+	if (state->mode == LUNIX_CHRDEV_MODE_BINARY) {
+		if (READ_ONCE(sensor->hist.head) == state->hist_pos)
+			return 0;
+		return !lunix_chrdev_filter_active(state) ||
+			(int32_t)(READ_ONCE(state->flt_hit) - state->hist_pos) > 0;
+	}
+
+	msr = sensor->msr;
+	if (READ_ONCE(msr->seq) == state->buf_seq)
+		return 0;// => no new data, keep sleeping
+	if (!lunix_chrdev_filter_active(state))
+		return 1;// => wake up
+
+	/* Only wake up for a measurement that has moved enough */
+	do {
+		version = lunix_msr_read_begin(msr);
+		raw = msr->values[state->type];
+		timestamp = msr->last_update;
+	} while (lunix_msr_read_retry(msr, version));
+	return lunix_chrdev_filter_pass(state, lunix_chrdev_convert(state->type, raw), timestamp);
+}
+
+/*
+ * Called by the line discipline, with the sensor spinlock held, for
+ * every sample the sensor receives. Only this file's sleepers are woken,
+ * and only if the sample gets through its change filter or, in window
+ * mode, completes a window.
+ */
+static void lunix_chrdev_state_notify(struct lunix_sub_struct *sub,
+	const struct lunix_sample_struct *smp){
+	struct lunix_chrdev_state_struct *state;
+
+	state = container_of(sub, struct lunix_chrdev_state_struct, sub);
+	if (state->mode == LUNIX_CHRDEV_MODE_WINDOW) {
+		if (lunix_chrdev_window_add(state, smp))
+			wake_up_interruptible(&state->wq);
+		return;
+	}
+	if (lunix_chrdev_filter_pass(state,
+			lunix_chrdev_convert(state->type, smp->values[state->type]),
+			smp->timestamp)) {
+		/* The sample has just been pushed to the history, if at all */
+		WRITE_ONCE(state->flt_hit, state->sensor->hist.head);
+		wake_up_interruptible(&state->wq);
+	}
+}
+
+static void lunix_chrdev_state_detach(struct lunix_sub_struct *sub){
+	struct lunix_chrdev_state_struct *state;
+
+	state = container_of(sub, struct lunix_chrdev_state_struct, sub);
+	wake_up_interruptible_all(&state->wq);
+}
+
+/*
+ * Makes binary mode reads start from the most
+ * recent sample the sensor has received, if any.
+ */
+static void lunix_chrdev_hist_rewind(struct lunix_chrdev_state_struct *state){
+	uint32_t head = READ_ONCE(state->sensor->hist.head);
+
+	state->hist_pos = head ? head - 1 : 0;
+	lunix_chrdev_filter_recheck(state);
+}
+
+/*
+ * Formats a raw measurement as text, returns its length. The text of
+ * every raw value in range has been rendered in advance, by mk_lookup_tables.
+ */
+static int lunix_chrdev_format(enum lunix_msr_enum type, uint16_t raw, unsigned char *buf){
+	static const struct lunix_lookup_text *lookup_text[N_LUNIX_MSR] = {
+		[BATT] = lookup_voltage_text,
+		[TEMP] = lookup_temperature_text,
+		[LIGHT] = lookup_light_text
+	};
+	const struct lunix_lookup_text *text;
+	long l;
+
+	if (unlikely(raw >= LUNIX_LOOKUP_SIZE)) {
+		l = lunix_chrdev_convert_slow(type, raw);
+		return scnprintf(buf, LUNIX_CHRDEV_BUFSZ, "%s%ld.%03ld\n",
+			(l < 0) ? "-" : "", abs(l) / 1000, abs(l) % 1000);
+	}
+
+	text = &lookup_text[type][raw];
+	BUILD_BUG_ON(sizeof(text->data) > LUNIX_CHRDEV_BUFSZ);
+	memcpy(buf, text->data, text->len);
+	return text->len;
 }
 
 /*
@@ -59,30 +326,36 @@ static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *st
 
 static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state){
 	struct lunix_sensor_struct *sensor;
+	struct lunix_msr_data_struct *msr;
 	uint16_t values;
-	long looked;
-  unsigned long flags;
-	int akeraio_meros, dekadiko_meros;
-	long* lookup[N_LUNIX_MSR];
-
-	lookup[BATT]= lookup_voltage;
-	lookup[TEMP]= lookup_temperature;
-	lookup[LIGHT]= lookup_light;
+	uint32_t version, seq;
+	uint64_t timestamp;
 
 	debug("chrdev_state_update:Entering\n");
 
 	if(!lunix_chrdev_state_needs_refresh(state)) { debug("@ lunix-chrdev-state_update: ABOUT TO RETURN -EGAIN\n"); return -EAGAIN;}
+
+	/*
+	 * Binary records are built straight from the history
+	 * at read time, window summaries as the samples arrive
+	 */
+	if (state->mode != LUNIX_CHRDEV_MODE_TEXT)
+		return 0;
+
 	/*
-	 * Grab the raw data quickly, hold the
-	 * spinlock for as little as possible.
+	 * Grab the raw data quickly, without blocking the line
+	 * discipline: retry if an update raced with us.
 	 */
-	/* ? */
 	sensor = state->sensor;
-	/* Why use spinlocks? See LDD3, p. 119 */
-	spin_lock_irqsave(&sensor->lock,flags); //bh? irqsave? irq?
-	values = sensor->msr_data[state->type]->values[0];
-	state->buf_timestamp = sensor->msr_data[state->type]->last_update;
-	spin_unlock_irqrestore(&sensor->lock,flags);
+	msr = sensor->msr;
+	do {
+		version = lunix_msr_read_begin(msr);
+		values = msr->values[state->type];
+		seq = msr->seq;
+		timestamp = msr->last_update;
+	} while (lunix_msr_read_retry(msr, version));
+	state->buf_seq = seq;
+	lunix_chrdev_filter_report(state, lunix_chrdev_convert(state->type, values), timestamp);
 
 	/*
 	 * Now we can take our time to format them,
@@ -90,13 +363,8 @@ static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state){
 	 */
 
   //state locks are handled by read
-	looked = lookup[state->type][values];
-	akeraio_meros = looked / 1000;
-	dekadiko_meros = looked % 1000;
-	sprintf(state->buf_data, "%d.%d\n", akeraio_meros, abs(dekadiko_meros));
-	state->buf_lim = strlen(state->buf_data);
-	//up(&state->lock);
-	debug("chrdev_state_update:leaving with data %d.%d\n",akeraio_meros,abs(dekadiko_meros));
+	state->buf_lim = lunix_chrdev_format(state->type, values, state->buf_data);
+	debug("chrdev_state_update:leaving\n");
 	return 0;
 }
 
@@ -105,10 +373,14 @@ static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state){
  * for the Lunix character device
  *************************************/
 
+static const struct file_operations lunix_chrdev_all_fops;
+static int lunix_chrdev_all_open(struct inode *inode, struct file *filp);
+
 static int lunix_chrdev_open(struct inode *inode, struct file *filp){
 	/* Declarations */
 	int ret, minor, sensor_no, type;
 	struct lunix_chrdev_state_struct *pd;
+	struct lunix_sensor_struct *sensor;
 	debug("Open:entering\n");
 	ret = -ENODEV;
 	if ((ret = nonseekable_open(inode, filp)) < 0)
@@ -120,6 +392,12 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp){
 	 */
 
 	minor = MINOR(inode->i_rdev);
+	if (minor == LUNIX_CHRDEV_ALL_MINOR) {
+		/* replace_fops() drops the reference chrdev_open() took */
+		replace_fops(filp, fops_get(&lunix_chrdev_all_fops));
+		ret = lunix_chrdev_all_open(inode, filp);
+		goto out;
+	}
 	sensor_no = minor >> 3;
 	type = minor & 0b111;//batt, light, temp
 
@@ -130,6 +408,13 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp){
     goto out;
   }
 
+	/* Readers may well show up before the first packet of the sensor */
+	sensor = lunix_sensor_get(sensor_no, GFP_KERNEL);
+	if (!sensor) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	/* Allocate a new Lunix character device private state structure */
   //pd = (struct lunix_chrdev_state_struct*) filp->private_data; ???
 	pd = kmalloc(sizeof(struct lunix_chrdev_state_struct), GFP_KERNEL);
@@ -138,30 +423,448 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp){
   //EFAULT is for bad address and ENOMEM is for no mem left
 
 	pd->type = type;
-	pd->sensor = &lunix_sensors[sensor_no];
-  //lunix_sensors is a table with structs for all the sensors and used as lunix_sensors[s_no]
+	pd->sensor = sensor;
 	pd->buf_lim = 0;
   //buf_data it can stay unallocated until a bug shows up
-	pd->buf_timestamp = 0;
+	pd->buf_seq = 0;
+	lunix_chrdev_hist_rewind(pd);
+	pd->mode = LUNIX_CHRDEV_MODE_TEXT;
+	pd->read_timeout_ms = 0;
+	pd->flt_mode = LUNIX_FILTER_ABS;
+	pd->flt_deadband = 0;
+	pd->flt_interval_ms = 0;
+	pd->flt_valid = 0;
+	spin_lock_init(&pd->win_lock);
+	hrtimer_init(&pd->win_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	pd->win_timer.function = lunix_chrdev_window_timer;
+	pd->win_ms = 0;
+	lunix_chrdev_window_reset(pd);
+	pd->stream = NULL;
+	pd->stream_claimed = 0;
 	sema_init(&pd->lock, 1);
+	init_waitqueue_head(&pd->wq);
+	pd->sub.update = lunix_chrdev_state_notify;
+	pd->sub.detach = lunix_chrdev_state_detach;
+	lunix_sensor_subscribe(pd->sensor, &pd->sub);
 out:
 	debug("Open:leaving, with ret = %d\n", ret);
 	return ret;
 }
 
+/*
+ * Streaming rings
+ */
+
+/* Number of pending records that makes stream readers wake up */
+static uint32_t lunix_chrdev_stream_watermark(struct lunix_chrdev_stream_struct *stream){
+	uint32_t wm = READ_ONCE(stream->page->watermark);
+
+	return clamp_t(uint32_t, wm, 1, stream->mask + 1);
+}
+
+static uint32_t lunix_chrdev_stream_pending(struct lunix_chrdev_stream_struct *stream){
+	return stream->head - READ_ONCE(stream->page->data_tail);
+}
+
+/*
+ * Called by the line discipline, with the sensor spinlock held,
+ * for every sample the sensor receives
+ */
+static void lunix_chrdev_stream_update(struct lunix_sub_struct *sub,
+	const struct lunix_sample_struct *smp){
+	struct lunix_chrdev_stream_struct *stream;
+	struct lunix_stream_page *pg;
+	uint32_t pending;
+
+	stream = container_of(sub, struct lunix_chrdev_stream_struct, sub);
+	pg = stream->page;
+
+	/*
+	 * Make sure userspace is done with a record before overwriting it,
+	 * pairs with userspace reading the record before advancing data_tail.
+	 * A bogus data_tail just makes the ring look full.
+	 */
+	pending = lunix_chrdev_stream_pending(stream);
+	smp_mb();
+	if (pending > stream->mask) {
+		WRITE_ONCE(pg->lost, pg->lost + 1);
+		return;
+	}
+
+	lunix_chrdev_fill_record(&stream->records[stream->head & stream->mask],
+		stream->state->type, smp);
+	smp_wmb();
+	WRITE_ONCE(pg->data_head, ++stream->head);
+
+	if (pending + 1 >= lunix_chrdev_stream_watermark(stream))
+		wake_up_interruptible(&stream->wq);
+}
+
+static void lunix_chrdev_stream_detach(struct lunix_sub_struct *sub){
+	struct lunix_chrdev_stream_struct *stream;
+
+	stream = container_of(sub, struct lunix_chrdev_stream_struct, sub);
+	wake_up_interruptible_all(&stream->wq);
+}
+
+/*
+ * Sets up the streaming ring of an open file and maps it, control page
+ * and all. Runs with mmap_lock held, while readers may fault on it with
+ * the state lock held: the ring is claimed with stream_claimed instead,
+ * and published for the unlocked poll() once complete.
+ */
+static int lunix_chrdev_stream_mmap(struct lunix_chrdev_state_struct *state,
+	struct vm_area_struct *vma){
+	struct lunix_chrdev_stream_struct *stream;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	/* Userspace needs to be able to advance data_tail */
+	if (!(vma->vm_flags & VM_SHARED) || size < 2 * PAGE_SIZE)
+		return -EINVAL;
+
+	if (cmpxchg(&state->stream_claimed, 0, 1))
+		return -EBUSY;
+
+	ret = -ENOMEM;
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (!stream)
+		goto out;
+
+	stream->page = vmalloc_user(size);
+	if (!stream->page)
+		goto out_with_stream;
+
+	ret = remap_vmalloc_range(vma, stream->page, 0);
+	if (ret < 0)
+		goto out_with_page;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+	stream->state = state;
+	stream->records = (void *)stream->page + PAGE_SIZE;
+	stream->mask = rounddown_pow_of_two((size - PAGE_SIZE) / sizeof(*stream->records)) - 1;
+	stream->page->data_size = stream->mask + 1;
+	stream->head = 0;
+	init_waitqueue_head(&stream->wq);
+	stream->sub.update = lunix_chrdev_stream_update;
+	stream->sub.detach = lunix_chrdev_stream_detach;
+
+	smp_store_release(&state->stream, stream);
+	lunix_sensor_subscribe(state->sensor, &stream->sub);
+	debug("mapped a stream of %u records\n", stream->mask + 1);
+	return 0;
+
+out_with_page:
+	vfree(stream->page);
+out_with_stream:
+	kfree(stream);
+out:
+	WRITE_ONCE(state->stream_claimed, 0);
+	return ret;
+}
+
+static void lunix_chrdev_stream_destroy(struct lunix_chrdev_state_struct *state){
+	struct lunix_chrdev_stream_struct *stream = state->stream;
+
+	lunix_sensor_unsubscribe(state->sensor, &stream->sub);
+	vfree(stream->page);
+	kfree(stream);
+	state->stream = NULL;
+}
+
 static int lunix_chrdev_release(struct inode *inode, struct file *filp){
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+
+	/* Any mappings of the stream are gone by now, they pin the file */
+	if (state && state->stream)
+		lunix_chrdev_stream_destroy(state);
+	if (state) {
+		lunix_sensor_unsubscribe(state->sensor, &state->sub);
+		/* Nothing can arm it any more */
+		hrtimer_cancel(&state->win_timer);
+	}
 	if (filp->private_data) kfree(filp->private_data);
 	//MOD_DEC_USE_COUNT;
 	return 0;
 }
 
+/*
+ * Takes the most recent sample of the sensor from its measurement record,
+ * where all measurements of a packet are kept together. Returns -ENODATA
+ * if the sensor has not received anything yet.
+ */
+static int lunix_chrdev_snapshot(struct lunix_chrdev_state_struct *state,
+	struct lunix_chrdev_snapshot *snap){
+	struct lunix_sample_struct smp;
+	int ret, type;
+
+	ret = lunix_sensor_latest(state->sensor, &smp);
+	if (ret < 0)
+		return ret;
+
+	BUILD_BUG_ON(ARRAY_SIZE(snap->raw) != N_LUNIX_MSR);
+	snap->timestamp = smp.timestamp;
+	snap->seq = smp.seq;
+	snap->sensor = smp.sensor;
+	for (type = 0; type < N_LUNIX_MSR; type++) {
+		snap->raw[type] = smp.values[type];
+		snap->value[type] = lunix_chrdev_convert(type, smp.values[type]);
+	}
+	return 0;
+}
+
 static long lunix_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
-	/* Why? */
-	return -EINVAL;
+	struct lunix_chrdev_state_struct *state;
+	struct lunix_chrdev_filter flt;
+	struct lunix_chrdev_snapshot snap;
+	unsigned long flags;
+	uint32_t win_ms, timeout_ms;
+	long ret = 0;
+	int mode;
+
+	state = filp->private_data;
+	WARN_ON(!state);
+
+	if (_IOC_TYPE(cmd) != LUNIX_IOC_MAGIC || _IOC_NR(cmd) > LUNIX_IOC_MAXNR)
+		return -ENOTTY;
+
+	if (down_interruptible(&state->lock))
+		return -ERESTARTSYS;
+
+	switch (cmd) {
+	case LUNIX_IOC_SET_MODE:
+		if (get_user(mode, (int __user *)arg)) {
+			ret = -EFAULT;
+			break;
+		}
+		if (mode != LUNIX_CHRDEV_MODE_TEXT && mode != LUNIX_CHRDEV_MODE_BINARY &&
+		    mode != LUNIX_CHRDEV_MODE_WINDOW) {
+			ret = -EINVAL;
+			break;
+		}
+		if (mode == LUNIX_CHRDEV_MODE_WINDOW && !state->win_ms) {
+			ret = -EINVAL;
+			break;
+		}
+		/* Drop any partially read textual measurement, or window */
+		spin_lock_irqsave(&state->win_lock, flags);
+		state->mode = mode;
+		lunix_chrdev_window_reset(state);
+		spin_unlock_irqrestore(&state->win_lock, flags);
+		filp->f_pos = 0;
+		lunix_chrdev_hist_rewind(state);
+		break;
+	case LUNIX_IOC_GET_MODE:
+		ret = put_user(state->mode, (int __user *)arg);
+		break;
+	case LUNIX_IOC_SET_FILTER:
+		if (copy_from_user(&flt, (void __user *)arg, sizeof(flt))) {
+			ret = -EFAULT;
+			break;
+		}
+		if ((flt.mode != LUNIX_FILTER_ABS && flt.mode != LUNIX_FILTER_PERCENT) ||
+		    (flt.mode == LUNIX_FILTER_PERCENT && flt.deadband > 100)) {
+			ret = -EINVAL;
+			break;
+		}
+		state->flt_mode = flt.mode;
+		state->flt_deadband = flt.deadband;
+		state->flt_interval_ms = flt.min_interval_ms;
+		lunix_chrdev_filter_recheck(state);
+		break;
+	case LUNIX_IOC_GET_FILTER:
+		flt.mode = state->flt_mode;
+		flt.deadband = state->flt_deadband;
+		flt.min_interval_ms = state->flt_interval_ms;
+		if (copy_to_user((void __user *)arg, &flt, sizeof(flt)))
+			ret = -EFAULT;
+		break;
+	case LUNIX_IOC_SET_WINDOW:
+		if (get_user(win_ms, (uint32_t __user *)arg)) {
+			ret = -EFAULT;
+			break;
+		}
+		if (!win_ms && state->mode == LUNIX_CHRDEV_MODE_WINDOW) {
+			ret = -EINVAL;
+			break;
+		}
+		/* Start over with the new window length */
+		spin_lock_irqsave(&state->win_lock, flags);
+		state->win_ms = win_ms;
+		lunix_chrdev_window_reset(state);
+		spin_unlock_irqrestore(&state->win_lock, flags);
+		break;
+	case LUNIX_IOC_GET_WINDOW:
+		ret = put_user(state->win_ms, (uint32_t __user *)arg);
+		break;
+	case LUNIX_IOC_SET_TIMEOUT:
+		if (get_user(timeout_ms, (uint32_t __user *)arg)) {
+			ret = -EFAULT;
+			break;
+		}
+		state->read_timeout_ms = timeout_ms;
+		break;
+	case LUNIX_IOC_GET_TIMEOUT:
+		ret = put_user(state->read_timeout_ms, (uint32_t __user *)arg);
+		break;
+	case LUNIX_IOC_GET_MSR_OFFSET:
+		ret = put_user((uint32_t)offset_in_page(state->sensor->msr), (uint32_t __user *)arg);
+		break;
+	case LUNIX_IOC_GET_SNAPSHOT:
+		ret = lunix_chrdev_snapshot(state, &snap);
+		if (ret == 0 && copy_to_user((void __user *)arg, &snap, sizeof(snap)))
+			ret = -EFAULT;
+		break;
+	default:
+		ret = -ENOTTY;
+	}
+
+	up(&state->lock);
+	return ret;
+}
+
+/*
+ * Copies every sample received since the previous read that gets through
+ * the change filter to userspace, as binary records, for as long as they
+ * fit in cnt bytes. Must be called with the character device state lock held.
+ */
+static ssize_t lunix_chrdev_read_records(struct lunix_chrdev_state_struct *state,
+	char __user *usrbuf, size_t cnt){
+	struct lunix_sample_struct smp[LUNIX_CHRDEV_RECORD_BATCH];
+	struct lunix_chrdev_record rec[LUNIX_CHRDEV_RECORD_BATCH];
+	size_t max, done;
+	uint32_t pos;
+	uint64_t flt_time;
+	long flt_value;
+	int i, n, k, flt_valid;
+
+	max = cnt / sizeof(*rec);
+	for (done = 0; done < max; done += k) {
+		/* Where to start over from, should the copy fail */
+		pos = state->hist_pos;
+		flt_valid = state->flt_valid;
+		flt_value = state->flt_value;
+		flt_time = state->flt_time;
+
+		n = lunix_hist_read(&state->sensor->hist, &state->hist_pos, smp,
+			min_t(size_t, max - done, LUNIX_CHRDEV_RECORD_BATCH));
+		if (n == 0)
+			break;
+
+		for (i = 0, k = 0; i < n; i++) {
+			lunix_chrdev_fill_record(&rec[k], state->type, &smp[i]);
+			if (!lunix_chrdev_filter_pass(state, rec[k].value, rec[k].timestamp))
+				continue;
+			lunix_chrdev_filter_report(state, rec[k].value, rec[k].timestamp);
+			k++;
+		}
+		if (copy_to_user(usrbuf + done * sizeof(*rec), rec, k * sizeof(*rec))) {
+			/* Records of the batch stay unread, the earlier ones are returned */
+			state->hist_pos = pos;
+			state->flt_valid = flt_valid;
+			state->flt_value = flt_value;
+			state->flt_time = flt_time;
+			return done ? done * sizeof(*rec) : -EFAULT;
+		}
+	}
+
+	/* The samples left over were judged against an older filter state */
+	if (READ_ONCE(state->sensor->hist.head) != state->hist_pos)
+		lunix_chrdev_filter_recheck(state);
+
+	return done * sizeof(*rec);
+}
+
+/*
+ * Copies the summary of the last complete window to userspace, if any.
+ * Must be called with the character device state lock held.
+ */
+static ssize_t lunix_chrdev_read_window(struct lunix_chrdev_state_struct *state,
+	char __user *usrbuf){
+	struct lunix_chrdev_summary sum;
+	struct lunix_chrdev_window_struct *win = &state->win_done;
+	unsigned long flags;
+	int ready;
+
+	spin_lock_irqsave(&state->win_lock, flags);
+	/* Nothing may have arrived since the current window ended */
+	lunix_chrdev_window_close(state, ktime_get_ns());
+	ready = state->win_ready;
+	if (ready) {
+		sum.start = win->start;
+		sum.end = win->start + lunix_chrdev_window_ns(state);
+		sum.count = win->count;
+		sum.sensor = state->sensor->id;
+		sum.type = state->type;
+		sum.min = win->min;
+		sum.max = win->max;
+		sum.mean = div_s64(win->sum, win->count);
+		sum.lost = state->win_lost;
+		state->win_ready = 0;
+		state->win_lost = 0;
+	}
+	spin_unlock_irqrestore(&state->win_lock, flags);
+
+	if (!ready)
+		return 0;
+	if (copy_to_user(usrbuf, &sum, sizeof(sum)))
+		return -EFAULT;
+	return sizeof(sum);
+}
+
+/*
+ * Readers of a file wait exclusively: one that goes away without
+ * reading must wake up another one, if there is fresh data.
+ */
+static void lunix_chrdev_pass_wakeup(struct lunix_chrdev_state_struct *state){
+	if (lunix_chrdev_state_needs_refresh(state))
+		wake_up_interruptible(&state->wq);
+}
+
+/*
+ * Sleeps until there is fresh data for the file, the line discipline
+ * is detached [see lunix_line_lost()], or *timeout jiffies pass; returns
+ * 0, -ENOLINK or -ETIMEDOUT respectively. Open-coded [LDD3, page 157],
+ * since there is no exclusive wait_event with a timeout.
+ */
+static int lunix_chrdev_wait(struct lunix_chrdev_state_struct *state,
+	int detach_cnt, long *timeout){
+	DEFINE_WAIT(wait);
+	int ret = 0;
+
+	for (;;) {
+		prepare_to_wait_exclusive(&state->wq, &wait, TASK_INTERRUPTIBLE);
+		if (lunix_chrdev_state_needs_refresh(state))
+			break;
+		if (lunix_line_lost(detach_cnt)) {
+			ret = -ENOLINK;
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		if (*timeout == 0) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+		*timeout = schedule_timeout(*timeout);
+	}
+	finish_wait(&state->wq, &wait);
+
+	/*
+	 * We may have been woken up for fresh data just as we gave up: pass
+	 * the wakeup on to the next exclusive waiter, or it would be lost.
+	 */
+	if (ret < 0)
+		lunix_chrdev_pass_wakeup(state);
+	return ret;
 }
 
 static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t cnt, loff_t *f_pos){
 	ssize_t ret;
+	long timeout;
+	int detach_cnt;
 
 	struct lunix_sensor_struct *sensor;
 	struct lunix_chrdev_state_struct *state;
@@ -172,30 +875,65 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
 	sensor = state->sensor;
 	WARN_ON(!sensor);
 
+	/* Only a detach from now on, or no line at all, makes us give up */
+	detach_cnt = atomic_read(&lunix_detach_cnt);
+
 	/* Lock? */
 	debug("@ lunix-chrdev-read: trying to lock\n");
 	if (down_interruptible(&state->lock)) return -ERESTARTSYS;
+
+	timeout = state->read_timeout_ms ?
+		msecs_to_jiffies(state->read_timeout_ms) : MAX_SCHEDULE_TIMEOUT;
+
+	/* Binary records and window summaries are never split across reads */
+	if ((state->mode == LUNIX_CHRDEV_MODE_BINARY && cnt < sizeof(struct lunix_chrdev_record)) ||
+	    (state->mode == LUNIX_CHRDEV_MODE_WINDOW && cnt < sizeof(struct lunix_chrdev_summary))) {
+		ret = -EINVAL;
+		goto out;
+	}
 	/*
 	 * If the cached character device state needs to be
 	 * updated by actual sensor data (i.e. we need to report
 	 * on a "fresh" measurement, do so
 	 */
 
+again:
 	if (*f_pos == 0) {
 		debug("@ lunix-chrdev-read: inside f_pos==0, entering while state_update\n");
 		while (lunix_chrdev_state_update(state) == -EAGAIN) {
 			up(&state->lock); //don't keep the semaphore, you might go to sleep
+			/* Non-blocking readers get to know there is nothing new */
+			if (filp->f_flags & O_NONBLOCK)
+				return lunix_line_lost(detach_cnt) ? -ENOLINK : -EAGAIN;
 			/* The process needs to sleep */
-			/* See LDD3, page 153 for a hint */
-			ret = wait_event_interruptible(sensor->wq, lunix_chrdev_state_needs_refresh(state)); //sleeps here
-			if (ret == -ERESTARTSYS) goto out;
+			ret = lunix_chrdev_wait(state, detach_cnt, &timeout); //sleeps here
+			if (ret < 0)
+				return ret;
 			// sleep
-			ret = down_interruptible(&state->lock);//goodmorning here is a semaphore.
-			if (ret == -ERESTARTSYS) goto out;
+			if (down_interruptible(&state->lock)) {//goodmorning here is a semaphore.
+				lunix_chrdev_pass_wakeup(state);
+				return -ERESTARTSYS;
+			}
 		}
 	}
 	debug("@ lunix-chrdev-read: outta if-while\n");
 
+	if (state->mode == LUNIX_CHRDEV_MODE_BINARY) {
+		ret = lunix_chrdev_read_records(state, usrbuf, cnt);
+		/* The change filter may have let none of the new samples through */
+		if (ret == 0)
+			goto again;
+		goto out;
+	}
+
+	if (state->mode == LUNIX_CHRDEV_MODE_WINDOW) {
+		ret = lunix_chrdev_read_window(state, usrbuf);
+		/* Another reader of the file may have got the window first */
+		if (ret == 0)
+			goto again;
+		goto out;
+	}
+
 	/* End of file */
 
 	/* Determine the number of cached bytes to copy to userspace */
@@ -222,8 +960,75 @@ out:
 	return ret;
 }
 
+/*
+ * A Lunix file is readable when there is a fresh measurement,
+ * or when a previously formatted one has only been read partially.
+ * Sleepers are woken up through the wait queue of the file, so one
+ * poll()/epoll loop can follow any number of sensors. While the line
+ * discipline is detached, the file is readable with an error, so that
+ * the next read() reports -ENOLINK instead of sleeping.
+ */
+static unsigned int lunix_chrdev_poll(struct file *filp, poll_table *wait){
+	struct lunix_chrdev_state_struct *state;
+	struct lunix_chrdev_stream_struct *stream;
+	unsigned int mask = 0;
+
+	state = filp->private_data;
+	WARN_ON(!state);
+
+	/* Once a stream is mapped, its watermark is what matters */
+	stream = smp_load_acquire(&state->stream);
+	if (stream) {
+		poll_wait(filp, &stream->wq, wait);
+		if (lunix_chrdev_stream_pending(stream) >=
+		    lunix_chrdev_stream_watermark(stream))
+			mask |= POLLIN | POLLRDNORM;
+	} else {
+		poll_wait(filp, &state->wq, wait);
+		if (filp->f_pos != 0 || lunix_chrdev_state_needs_refresh(state))
+			mask |= POLLIN | POLLRDNORM;
+	}
+
+	if (lunix_line_down())
+		mask |= POLLIN | POLLRDNORM | POLLERR;
+	return mask;
+}
+
+/*
+ * Map the page holding the record of the most recent measurements
+ * read-only into userspace. Readers find the record of the sensor with
+ * LUNIX_IOC_GET_MSR_OFFSET and sample it using the version counter
+ * protocol described in lunix.h, without any system calls.
+ *
+ * Mapping at LUNIX_CHRDEV_STREAM_PGOFF sets up a streaming ring instead.
+ */
 static int lunix_chrdev_mmap(struct file *filp, struct vm_area_struct *vma){
-	return -EINVAL;
+	struct lunix_chrdev_state_struct *state;
+	unsigned long pfn;
+
+	state = filp->private_data;
+	WARN_ON(!state);
+
+	/*
+	 * Not under the state lock: read() and ioctl() hold it across
+	 * copies to and from userspace, which may need mmap_lock
+	 */
+	if (vma->vm_pgoff == LUNIX_CHRDEV_STREAM_PGOFF)
+		return lunix_chrdev_stream_mmap(state, vma);
+
+	/* The record of a sensor lies within a single page */
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+
+	/* Only the line discipline gets to update sensor data */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+	pfn = page_to_pfn(virt_to_page(state->sensor->msr));
+	debug("mapping sensor page, pfn = 0x%lx\n", pfn);
+	return remap_pfn_range(vma, vma->vm_start, pfn, PAGE_SIZE, vma->vm_page_prot);
 }
 
 static struct file_operations lunix_chrdev_fops ={
@@ -232,18 +1037,256 @@ static struct file_operations lunix_chrdev_fops ={
 	.release        = lunix_chrdev_release,
 	.read           = lunix_chrdev_read,
 	.unlocked_ioctl = lunix_chrdev_ioctl,
+	.poll           = lunix_chrdev_poll,
 	.mmap           = lunix_chrdev_mmap
 };
 
+/*************************************
+ * The aggregate node [/dev/lunix-all]
+ *************************************/
+
+static int lunix_chrdev_all_open(struct inode *inode, struct file *filp){
+	struct lunix_chrdev_all_state_struct *state;
+	uint32_t head;
+
+	state = kmalloc(sizeof(*state), GFP_KERNEL);
+	if (!state)
+		return -ENOMEM;
+
+	/* Start from the most recent sample, like the per-sensor nodes do */
+	head = READ_ONCE(lunix_all_hist.head);
+	state->hist_pos = head ? head - 1 : 0;
+	sema_init(&state->lock, 1);
+	filp->private_data = state;
+	return 0;
+}
+
+static int lunix_chrdev_all_release(struct inode *inode, struct file *filp){
+	kfree(filp->private_data);
+	return 0;
+}
+
+static int lunix_chrdev_all_needs_refresh(struct lunix_chrdev_all_state_struct *state){
+	return READ_ONCE(lunix_all_hist.head) != state->hist_pos;
+}
+
+/*
+ * Returns three binary records, one per measurement, for every
+ * sample received since the previous read, as long as they fit
+ */
+static ssize_t lunix_chrdev_all_read(struct file *filp, char __user *usrbuf, size_t cnt, loff_t *f_pos){
+	struct lunix_chrdev_all_state_struct *state = filp->private_data;
+	struct lunix_sample_struct smp[LUNIX_CHRDEV_RECORD_BATCH];
+	struct lunix_chrdev_record rec[LUNIX_CHRDEV_RECORD_BATCH * N_LUNIX_MSR];
+	size_t max, done;
+	ssize_t ret;
+	int i, n, type, detach_cnt;
+
+	max = cnt / sizeof(rec[0]) / N_LUNIX_MSR;
+	if (max == 0)
+		return -EINVAL;
+	detach_cnt = atomic_read(&lunix_detach_cnt);
+
+	if (down_interruptible(&state->lock))
+		return -ERESTARTSYS;
+
+	while (!lunix_chrdev_all_needs_refresh(state)) {
+		up(&state->lock);
+		if (filp->f_flags & O_NONBLOCK)
+			return lunix_line_lost(detach_cnt) ? -ENOLINK : -EAGAIN;
+		if (wait_event_interruptible(lunix_all_wq, lunix_chrdev_all_needs_refresh(state) ||
+				lunix_line_lost(detach_cnt)))
+			return -ERESTARTSYS;
+		if (lunix_line_lost(detach_cnt) &&
+		    !lunix_chrdev_all_needs_refresh(state))
+			return -ENOLINK;
+		if (down_interruptible(&state->lock))
+			return -ERESTARTSYS;
+	}
+
+	for (done = 0; done < max; done += n) {
+		n = lunix_hist_read(&lunix_all_hist, &state->hist_pos, smp,
+			min_t(size_t, max - done, LUNIX_CHRDEV_RECORD_BATCH));
+		if (n == 0)
+			break;
+
+		for (i = 0; i < n; i++)
+			for (type = 0; type < N_LUNIX_MSR; type++)
+				lunix_chrdev_fill_record(&rec[i * N_LUNIX_MSR + type], type, &smp[i]);
+		if (copy_to_user(usrbuf + done * sizeof(rec[0]) * N_LUNIX_MSR, rec,
+				n * sizeof(rec[0]) * N_LUNIX_MSR)) {
+			ret = -EFAULT;
+			goto out;
+		}
+	}
+	ret = done * sizeof(rec[0]) * N_LUNIX_MSR;
+out:
+	up(&state->lock);
+	return ret;
+}
+
+static unsigned int lunix_chrdev_all_poll(struct file *filp, poll_table *wait){
+	struct lunix_chrdev_all_state_struct *state = filp->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &lunix_all_wq, wait);
+	if (lunix_chrdev_all_needs_refresh(state))
+		mask |= POLLIN | POLLRDNORM;
+	/* As for the sensor files, see lunix_chrdev_poll() */
+	if (lunix_line_down())
+		mask |= POLLIN | POLLRDNORM | POLLERR;
+	return mask;
+}
+
+/*
+ * Waiting for any of a set of sensors to receive a sample
+ * [LUNIX_IOC_WAIT_ANY], n being the number of valid bits in the set
+ */
+static int lunix_chrdev_wait_pending(struct lunix_chrdev_wait *w, int n){
+	struct lunix_sensor_struct *s;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!(w->sensors & (1ULL << i)))
+			continue;
+		/* A sensor not allocated yet has received nothing */
+		s = lunix_sensor_find(w->base + i);
+		if ((s ? READ_ONCE(s->seq) : 0) != w->seq[i])
+			return 1;
+	}
+	return 0;
+}
+
+static long lunix_chrdev_wait_any(struct lunix_chrdev_wait __user *uw){
+	struct lunix_chrdev_wait *w;
+	struct lunix_sensor_struct *s;
+	struct lunix_sample_struct smp;
+	uint64_t changed = 0;
+	long ret;
+	int i, n, type, detach_cnt;
+
+	/* Too large for the stack */
+	w = kmalloc(sizeof(*w), GFP_KERNEL);
+	if (!w)
+		return -ENOMEM;
+	if (copy_from_user(w, uw, sizeof(*w))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	ret = -EINVAL;
+	if (w->base >= lunix_sensor_cnt)
+		goto out;
+	n = min_t(uint32_t, lunix_sensor_cnt - w->base, LUNIX_WAIT_MAX);
+	if (n < LUNIX_WAIT_MAX && (w->sensors >> n))
+		goto out;
+
+	detach_cnt = atomic_read(&lunix_detach_cnt);
+	if (w->timeout_ms < 0)
+		ret = wait_event_interruptible(lunix_all_wq, lunix_chrdev_wait_pending(w, n) ||
+			lunix_line_lost(detach_cnt));
+	else
+		ret = wait_event_interruptible_timeout(lunix_all_wq, lunix_chrdev_wait_pending(w, n) ||
+			lunix_line_lost(detach_cnt),
+			msecs_to_jiffies(w->timeout_ms));
+	if (ret < 0)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		if (!(w->sensors & (1ULL << i)))
+			continue;
+		s = lunix_sensor_find(w->base + i);
+		if (!s || lunix_sensor_latest(s, &smp) < 0 || smp.seq == w->seq[i])
+			continue;
+
+		changed |= 1ULL << i;
+		w->seq[i] = smp.seq;
+		for (type = 0; type < N_LUNIX_MSR; type++)
+			w->value[i][type] = (w->types & (1 << type)) ?
+				lunix_chrdev_convert(type, smp.values[type]) : 0;
+	}
+	w->sensors = changed;
+
+	ret = -ENOLINK;
+	if (!changed && lunix_line_lost(detach_cnt))
+		goto out;
+	ret = hweight64(changed);
+	if (copy_to_user(uw, w, sizeof(*w)))
+		ret = -EFAULT;
+out:
+	kfree(w);
+	return ret;
+}
+
+/*
+ * The line discipline updates the counters without any locking,
+ * a snapshot of them may be slightly out of date
+ */
+static long lunix_chrdev_get_stats(struct lunix_chrdev_stats __user *ust){
+	struct lunix_chrdev_stats st;
+
+	memset(&st, 0, sizeof(st));
+	st.packets = READ_ONCE(lunix_protocol_state.packets);
+	st.crc_errors = READ_ONCE(lunix_protocol_state.crc_errors);
+	st.framing_errors = READ_ONCE(lunix_protocol_state.framing_errors);
+	return copy_to_user(ust, &st, sizeof(st)) ? -EFAULT : 0;
+}
+
+static long lunix_chrdev_all_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
+	if (_IOC_TYPE(cmd) != LUNIX_IOC_MAGIC || _IOC_NR(cmd) > LUNIX_IOC_MAXNR)
+		return -ENOTTY;
+
+	switch (cmd) {
+	case LUNIX_IOC_WAIT_ANY:
+		return lunix_chrdev_wait_any((struct lunix_chrdev_wait __user *)arg);
+	case LUNIX_IOC_GET_STATS:
+		return lunix_chrdev_get_stats((struct lunix_chrdev_stats __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations lunix_chrdev_all_fops = {
+	.owner          = THIS_MODULE,
+	.release        = lunix_chrdev_all_release,
+	.read           = lunix_chrdev_all_read,
+	.unlocked_ioctl = lunix_chrdev_all_ioctl,
+	.poll           = lunix_chrdev_all_poll
+};
+
+/*
+ * Device nodes are created as sensors get allocated [/dev/lunix<NO>-<TYPE>],
+ * from the setup work of the sensor, since sensors may show up in atomic context
+ */
+void lunix_chrdev_sensor_added(struct lunix_sensor_struct *s){
+	static const char *names[N_LUNIX_MSR] = {
+		[BATT] = "batt",
+		[TEMP] = "temp",
+		[LIGHT] = "light"
+	};
+	struct device *dev;
+	int type;
+
+	for (type = 0; type < N_LUNIX_MSR; type++) {
+		dev = device_create(lunix_chrdev_class, NULL,
+			MKDEV(LUNIX_CHRDEV_MAJOR, (s->id << 3) | type), NULL,
+			"lunix%d-%s", s->id, names[type]);
+		if (IS_ERR(dev))
+			printk(KERN_WARNING "Failed to create node lunix%d-%s, ret = %ld\n",
+				s->id, names[type], PTR_ERR(dev));
+	}
+}
+
 int lunix_chrdev_init(void){
 	/*
 	 * Register the character device with the kernel, asking for
-	 * a range of minor numbers (number of sensors * 8 measurements / sensor)
-	 * beginning with LINUX_CHRDEV_MAJOR:0
+	 * a range of minor numbers (number of sensors * 8 measurements / sensor,
+	 * plus the aggregate node) beginning with LINUX_CHRDEV_MAJOR:0
 	 */
 	int ret;
 	dev_t dev_no;
-	unsigned int lunix_minor_cnt = lunix_sensor_cnt << 3;
+	struct device *dev;
+	unsigned int lunix_minor_cnt = LUNIX_CHRDEV_ALL_MINOR + 1;
 
 	debug("initializing character device\n");
 	cdev_init(&lunix_chrdev_cdev, &lunix_chrdev_fops);
@@ -257,16 +1300,34 @@ int lunix_chrdev_init(void){
 		debug("failed to register region, ret = %d\n", ret);
 		goto out;
 	}
+	/* Opening a node may allocate a sensor, and create its nodes */
+	lunix_chrdev_class = class_create(THIS_MODULE, "lunix");
+	if (IS_ERR(lunix_chrdev_class)) {
+		ret = PTR_ERR(lunix_chrdev_class);
+		debug("failed to create device class, ret = %d\n", ret);
+		goto out_with_chrdev_region;
+	}
 	/* cdev_add? */
   //add a character device to the system cdev_add(cdev_stuct,device_no,#ofminor)
 	ret = cdev_add(&lunix_chrdev_cdev, dev_no, lunix_minor_cnt);
 	if (ret < 0) {
 		debug("failed to add character device\n");
-		goto out_with_chrdev_region;
+		goto out_with_class;
+	}
+	dev = device_create(lunix_chrdev_class, NULL,
+		MKDEV(LUNIX_CHRDEV_MAJOR, LUNIX_CHRDEV_ALL_MINOR), NULL, "lunix-all");
+	if (IS_ERR(dev)) {
+		ret = PTR_ERR(dev);
+		debug("failed to create the aggregate node, ret = %d\n", ret);
+		goto out_with_cdev;
 	}
 	debug("completed successfully\n");
 	return 0;
 
+out_with_cdev:
+	cdev_del(&lunix_chrdev_cdev);
+out_with_class:
+	class_destroy(lunix_chrdev_class);
 out_with_chrdev_region:
 	unregister_chrdev_region(dev_no, lunix_minor_cnt);
 out:
@@ -275,9 +1336,20 @@ out:
 
 void lunix_chrdev_destroy(void){
 	dev_t dev_no;
-	unsigned int lunix_minor_cnt = lunix_sensor_cnt << 3;
+	struct lunix_sensor_struct *s;
+	unsigned int lunix_minor_cnt = LUNIX_CHRDEV_ALL_MINOR + 1;
+	int id, type;
 
 	debug("Destroy:entering\n");
+	idr_for_each_entry(&lunix_sensors, s, id) {
+		cancel_work_sync(&s->setup_work);
+		for (type = 0; type < N_LUNIX_MSR; type++)
+			device_destroy(lunix_chrdev_class,
+				MKDEV(LUNIX_CHRDEV_MAJOR, (id << 3) | type));
+	}
+	device_destroy(lunix_chrdev_class, MKDEV(LUNIX_CHRDEV_MAJOR, LUNIX_CHRDEV_ALL_MINOR));
+	class_destroy(lunix_chrdev_class);
+
 	dev_no = MKDEV(LUNIX_CHRDEV_MAJOR, 0);
 	cdev_del(&lunix_chrdev_cdev);
 	unregister_chrdev_region(dev_no, lunix_minor_cnt);
@@ -23,9 +23,39 @@
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/hrtimer.h>
 
 #include "lunix.h"
 
+#define LUNIX_CHRDEV_ALL_MINOR	(lunix_sensor_cnt << 3)	/* The aggregate node */
+
+/*
+ * A streaming ring, mapped to userspace, that receives a record
+ * for every sample of the sensor directly from the line discipline
+ */
+struct lunix_chrdev_stream_struct {
+	struct lunix_sub_struct sub;
+	struct lunix_chrdev_state_struct *state;
+
+	struct lunix_stream_page *page;		/* Control page, followed by the records */
+	struct lunix_chrdev_record *records;
+	uint32_t head;				/* Private copy of page->data_head */
+	uint32_t mask;
+
+	/* Woken up once the watermark is reached */
+	wait_queue_head_t wq;
+};
+
+/*
+ * A tumbling window of measurements, aggregated as they arrive
+ */
+struct lunix_chrdev_window_struct {
+	uint64_t start;		/* A multiple of the window length */
+	uint32_t count;
+	int64_t sum;
+	long min, max;
+};
+
 /*
  * Private state for an open character device node
  */
@@ -33,35 +63,250 @@ struct lunix_chrdev_state_struct {
 	enum lunix_msr_enum type;
 	struct lunix_sensor_struct *sensor;
 
+	/*
+	 * Subscription to the sensor updates, and the processes waiting
+	 * on this file for fresh data. Readers sharing the file wait
+	 * exclusively, only one of them can get each update anyway.
+	 */
+	struct lunix_sub_struct sub;
+	wait_queue_head_t wq;
+
 	/* A buffer used to hold cached textual info */
 	int buf_lim;
 	unsigned char buf_data[LUNIX_CHRDEV_BUFSZ];
-	uint32_t buf_timestamp;
+	uint32_t buf_seq;
+
+	/* Next sample of the sensor history to return in binary mode */
+	uint32_t hist_pos;
+
+	/*
+	 * Change filter [see struct lunix_chrdev_filter], and the last
+	 * measurement it let through. The subscriber callback reads them
+	 * unlocked, at worst it wakes up a reader for nothing.
+	 */
+	uint32_t flt_mode;
+	uint32_t flt_deadband;
+	uint32_t flt_interval_ms;
+	int flt_valid;
+	long flt_value;
+	uint64_t flt_time;
+	uint32_t flt_hit;	/* See lunix_chrdev_filter_recheck() */
+
+	/*
+	 * Window mode: the window being filled in by the subscriber
+	 * callback, and the last one completed, not read yet. The
+	 * timer completes the current window as soon as it ends.
+	 */
+	spinlock_t win_lock;
+	struct hrtimer win_timer;
+	uint32_t win_ms;
+	struct lunix_chrdev_window_struct win_cur;
+	struct lunix_chrdev_window_struct win_done;
+	int win_ready;
+	uint32_t win_lost;
+
+	/* One of LUNIX_CHRDEV_MODE_* */
+	int mode;
+
+	/* How long read() waits for fresh data, 0 for ever */
+	uint32_t read_timeout_ms;
+
+	/*
+	 * The streaming ring, once it has been mapped. Claimed by the one
+	 * mmap() that sets it up, then published for poll() to read unlocked.
+	 */
+	int stream_claimed;
+	struct lunix_chrdev_stream_struct *stream;
 
 	struct semaphore lock;
 
 	/*
-	 * Fixme: Any mode settings? e.g. blocking vs. non-blocking
+	 * Blocking vs. non-blocking mode is taken from
+	 * filp->f_flags on every read(), so fcntl() works too.
 	 */
 };
 
+/*
+ * Private state for an open aggregate node [/dev/lunix-all]
+ */
+struct lunix_chrdev_all_state_struct {
+	/* Next sample of the aggregate history to return */
+	uint32_t hist_pos;
+
+	struct semaphore lock;
+};
+
 /*
  * Function prototypes
  */
 int lunix_chrdev_init(void);
 void lunix_chrdev_destroy(void);
+void lunix_chrdev_sensor_added(struct lunix_sensor_struct *s);
 
+#else
+#include <inttypes.h>
 #endif	/* __KERNEL__ */
 
 #include <linux/ioctl.h>
 
+/*
+ * A blocking read() that runs out of time, according to LUNIX_IOC_SET_TIMEOUT,
+ * fails with ETIMEDOUT. Readers sleeping when the line discipline is detached
+ * from its TTY, as well as LUNIX_IOC_WAIT_ANY, fail with ENOLINK. So do
+ * reads with nothing new to return while it is not attached at all, blocking
+ * or not; poll() reports POLLERR along with POLLIN for as long as that lasts.
+ */
+
+/*
+ * Read modes of an open character device node
+ */
+#define LUNIX_CHRDEV_MODE_TEXT		0	/* One formatted line per read(), the default */
+#define LUNIX_CHRDEV_MODE_BINARY	1	/* struct lunix_chrdev_record, see below */
+#define LUNIX_CHRDEV_MODE_WINDOW	2	/* struct lunix_chrdev_summary, see below */
+
+/*
+ * A fixed-size measurement record, returned by read() in binary mode.
+ * Each read() returns as many whole records as fit in the user buffer,
+ * one for every sample received since the previous read(), so the
+ * read() size must be at least sizeof(struct lunix_chrdev_record).
+ */
+struct lunix_chrdev_record {
+	uint64_t timestamp;	/* CLOCK_MONOTONIC time of the update, in nanoseconds */
+	uint32_t seq;		/* Sequence number of the update */
+	uint16_t sensor;	/* Sensor number, as in /dev/lunix<NO>-<TYPE> */
+	uint16_t type;		/* 0: batt, 1: temp, 2: light */
+	uint16_t raw;		/* Raw 16-bit measurement */
+	uint16_t reserved;
+	int32_t value;		/* Converted value, in thousandths */
+};
+
+/*
+ * A summary of a tumbling window of samples, returned by read()
+ * in window mode, once per window. Windows are LUNIX_IOC_SET_WINDOW
+ * milliseconds long and aligned to multiples of their length on the
+ * CLOCK_MONOTONIC time line. Windows without any samples are skipped.
+ * A window can be read as soon as it has ended, blocked readers are
+ * woken up right then. Only the last complete window is kept, the ones
+ * overwritten before being read are counted in lost. Sliding windows are not supported.
+ */
+struct lunix_chrdev_summary {
+	uint64_t start;		/* Start of the window, CLOCK_MONOTONIC nanoseconds */
+	uint64_t end;		/* End of the window, exclusive */
+	uint32_t count;		/* Number of samples in the window */
+	uint16_t sensor;
+	uint16_t type;
+	int32_t min;		/* Converted values, in thousandths */
+	int32_t max;
+	int32_t mean;
+	uint32_t lost;		/* Windows dropped since the previous read() */
+};
+
+/*
+ * The aggregate node [/dev/lunix-all] comes right after the nodes of
+ * the last sensor, at minor lunix_sensor_cnt * 8. It always returns
+ * binary records, for every measurement of every sensor, in the order
+ * the samples were received. Each read() returns whole samples only,
+ * so its size must be at least 3 * sizeof(struct lunix_chrdev_record).
+ */
+
+/*
+ * Streaming ring, mapped with mmap(MAP_SHARED) at page offset
+ * LUNIX_CHRDEV_STREAM_PGOFF. The first page is the control page below.
+ * The rest of the mapping holds data_size records, from offset
+ * PAGE_SIZE on, in the same format as binary mode reads.
+ *
+ * The kernel appends a record for every sample the sensor receives and
+ * advances data_head. Userspace consumes records up to data_head, then
+ * advances data_tail. When the ring is full, new records are dropped and
+ * counted in lost. poll() reports the file readable, and wakes up
+ * sleepers, only once at least watermark records are pending.
+ */
+#define LUNIX_CHRDEV_STREAM_PGOFF	1
+
+struct lunix_stream_page {
+	uint32_t data_head;	/* Written by the kernel */
+	uint32_t data_tail;	/* Written by userspace */
+	uint32_t data_size;	/* Number of records in the ring, a power of two */
+	uint32_t watermark;	/* Written by userspace, 0 means 1 */
+	uint32_t lost;		/* Records dropped because the ring was full */
+};
+
+/*
+ * Change filter of an open file. A measurement is only reported, and
+ * only wakes up readers, once it differs from the last one reported by
+ * at least deadband, and at least min_interval_ms after it. Zero disables
+ * either check. In binary mode, the samples filtered out are skipped.
+ * The filter does not apply to the streaming ring.
+ */
+#define LUNIX_FILTER_ABS		0	/* deadband in thousandths, like record values */
+#define LUNIX_FILTER_PERCENT		1	/* deadband in percent of the last value reported */
+
+struct lunix_chrdev_filter {
+	uint32_t mode;
+	uint32_t deadband;
+	uint32_t min_interval_ms;
+};
+
+/*
+ * All measurements of a sensor, from the most recent packet it has
+ * received, as returned by LUNIX_IOC_GET_SNAPSHOT on any of its nodes
+ */
+struct lunix_chrdev_snapshot {
+	uint64_t timestamp;	/* CLOCK_MONOTONIC time of the update, in nanoseconds */
+	uint32_t seq;		/* Sequence number of the update */
+	uint16_t sensor;
+	uint16_t raw[3];	/* Indexed by type: 0: batt, 1: temp, 2: light */
+	int32_t value[3];	/* Converted values, in thousandths */
+};
+
+/*
+ * Waiting on the aggregate node for any of up to LUNIX_WAIT_MAX sensors,
+ * base to base + 63, to receive a sample [LUNIX_IOC_WAIT_ANY], like
+ * select() does for files. Every packet updates all measurements of
+ * a sensor, so a sensor has changed once its sequence number differs
+ * from the one passed in; start with zeroes to get the current values.
+ * Returns the number of sensors that changed, 0 on timeout.
+ */
+#define LUNIX_WAIT_MAX			64
+
+struct lunix_chrdev_wait {
+	uint64_t sensors;	/* In: the set of sensors, out: the ones that changed */
+	uint32_t base;		/* In: the sensor of bit 0 */
+	uint32_t types;		/* In: the measurements to return, bit 0: batt, 1: temp, 2: light */
+	int32_t timeout_ms;	/* In: -1 waits for ever, 0 does not wait */
+	uint32_t reserved;
+	uint32_t seq[LUNIX_WAIT_MAX];		/* In: the last ones seen, out: the current ones */
+	int32_t value[LUNIX_WAIT_MAX][3];	/* Out: converted values, in thousandths */
+};
+
+/*
+ * Statistics of the packets received from the base station,
+ * returned by LUNIX_IOC_GET_STATS on the aggregate node
+ */
+struct lunix_chrdev_stats {
+	uint64_t packets;	/* Complete packets received */
+	uint64_t crc_errors;	/* Packets dropped because of a bad CRC */
+	uint64_t framing_errors;	/* Packets lost to line noise */
+};
+
 /*
  * Definition of ioctl commands
  */
 #define LUNIX_IOC_MAGIC			LUNIX_CHRDEV_MAJOR
-//#define LUNIX_IOC_EXAMPLE		_IOR(LUNIX_IOC_MAGIC, 0, void *)
+#define LUNIX_IOC_SET_MODE		_IOW(LUNIX_IOC_MAGIC, 0, int)
+#define LUNIX_IOC_GET_MODE		_IOR(LUNIX_IOC_MAGIC, 1, int)
+#define LUNIX_IOC_SET_FILTER		_IOW(LUNIX_IOC_MAGIC, 2, struct lunix_chrdev_filter)
+#define LUNIX_IOC_GET_FILTER		_IOR(LUNIX_IOC_MAGIC, 3, struct lunix_chrdev_filter)
+#define LUNIX_IOC_SET_WINDOW		_IOW(LUNIX_IOC_MAGIC, 4, uint32_t)	/* in milliseconds */
+#define LUNIX_IOC_GET_WINDOW		_IOR(LUNIX_IOC_MAGIC, 5, uint32_t)
+#define LUNIX_IOC_GET_SNAPSHOT		_IOR(LUNIX_IOC_MAGIC, 6, struct lunix_chrdev_snapshot)
+#define LUNIX_IOC_WAIT_ANY		_IOWR(LUNIX_IOC_MAGIC, 7, struct lunix_chrdev_wait)
+#define LUNIX_IOC_SET_TIMEOUT		_IOW(LUNIX_IOC_MAGIC, 8, uint32_t)	/* in milliseconds */
+#define LUNIX_IOC_GET_TIMEOUT		_IOR(LUNIX_IOC_MAGIC, 9, uint32_t)
+#define LUNIX_IOC_GET_MSR_OFFSET	_IOR(LUNIX_IOC_MAGIC, 10, uint32_t)	/* see lunix.h */
+#define LUNIX_IOC_GET_STATS		_IOR(LUNIX_IOC_MAGIC, 11, struct lunix_chrdev_stats)
 
-#define LUNIX_IOC_MAXNR			0	
+#define LUNIX_IOC_MAXNR			11
 
 #endif	/* _LUNIX_H */
 
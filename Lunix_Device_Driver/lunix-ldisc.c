@@ -41,6 +41,7 @@ static int lunix_ldisc_open(struct tty_struct *tty)
 		return -EBUSY;
 
 	tty->receive_room = 65536; /* No flow control, FIXME */
+	lunix_sensors_attach();
 
 	debug("lunix ldisc associated with TTY %s\n", tty->name);
 	return 0;
@@ -54,8 +55,8 @@ static int lunix_ldisc_open(struct tty_struct *tty)
 static void lunix_ldisc_close(struct tty_struct *tty)
 {
 	atomic_inc(&lunix_disc_available);
-	/* FIXME */
-	/* Shouldn't we wake up all sleepers in all sensors here? */
+	/* Sleepers would otherwise wait for the next base station */
+	lunix_sensors_detach();
 	debug("lunix ldisc being closed\n");
 }
 
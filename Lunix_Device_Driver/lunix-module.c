@@ -7,6 +7,7 @@
  *
  */
 
+#include <linux/log2.h>
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
@@ -20,7 +21,8 @@
  * Global state for Lunix:TNG sensors
  */
 int lunix_sensor_cnt = LUNIX_SENSOR_CNT;
-struct lunix_sensor_struct *lunix_sensors;
+int lunix_history_depth = LUNIX_HISTORY_DEPTH;
+int lunix_crc_check = 1;
 struct lunix_protocol_state_struct lunix_protocol_state;
 
 /*
@@ -30,43 +32,52 @@ struct lunix_protocol_state_struct lunix_protocol_state;
 int __init lunix_module_init(void)
 {
 	int ret;
-	int si_done;
 
 	printk(KERN_INFO "Initializing the Lunix:TNG module [max %d sensors]\n",
 		lunix_sensor_cnt);
 
-	ret = -ENOMEM;
-	lunix_sensors = kzalloc(sizeof(*lunix_sensors) * lunix_sensor_cnt, GFP_KERNEL);
-	if (!lunix_sensors) {
-		printk(KERN_ERR "Failed to allocate memory for Lunix sensors\n");
+	ret = -EINVAL;
+	if (lunix_sensor_cnt < 1 || lunix_sensor_cnt > LUNIX_SENSOR_MAX) {
+		printk(KERN_ERR "Number of sensors must be between 1 and %d\n",
+			LUNIX_SENSOR_MAX);
 		goto out;
 	}
-	lunix_protocol_init(&lunix_protocol_state);
+	if (lunix_history_depth < 2 || lunix_history_depth > LUNIX_HISTORY_MAX) {
+		printk(KERN_ERR "History depth must be between 2 and %d samples\n",
+			LUNIX_HISTORY_MAX);
+		goto out;
+	}
+	lunix_history_depth = roundup_pow_of_two(lunix_history_depth);
 
 	/*
-	 * Initialize all sensors. On exit, si_done is the index of the last
-	 * successfully initialized sensor.
+	 * Any decoders of other packet types are to
+	 * be registered right after this one
 	 */
-	for (si_done = -1; si_done < lunix_sensor_cnt - 1; si_done++) {
-		debug("initializing sensor %d\n", si_done + 1);
-		ret = lunix_sensor_init(&lunix_sensors[si_done + 1]);
-		debug("initialized sensor %d, ret = %d\n", si_done + 1, ret);
-		if (ret < 0) {
-			goto out_with_sensors;
-		}
-	}
+	if ((ret = lunix_protocol_init(&lunix_protocol_state)) < 0)
+		goto out;
 
 	/*
-	 * Initialize the Lunix line discipline
+	 * Sensors themselves are allocated on demand, only the table
+	 * of their record pages and the aggregate history are needed
+	 * up front
 	 */
-	if ((ret = lunix_ldisc_init()) < 0)
+	if ((ret = lunix_sensors_init()) < 0)
+		goto out;
+	if ((ret = lunix_all_init()) < 0)
 		goto out_with_sensors;
 
 	/*
-	 * Initialize the Lunix character device
+	 * Initialize the Lunix character device, before any
+	 * packets can arrive and create sensors and their nodes
 	 */
 	if ((ret = lunix_chrdev_init()) < 0)
-		goto out_with_ldisc;
+		goto out_with_all;
+
+	/*
+	 * Initialize the Lunix line discipline
+	 */
+	if ((ret = lunix_ldisc_init()) < 0)
+		goto out_with_chrdev;
 
 	return 0;
 
@@ -74,15 +85,15 @@ int __init lunix_module_init(void)
 	 * Something's gone wrong, undo everything
 	 * we've done up to this point
 	 */
-out_with_ldisc:
-	debug("at out_with_ldisc\n");
-	lunix_ldisc_destroy();
+out_with_chrdev:
+	debug("at out_with_chrdev\n");
+	lunix_chrdev_destroy();
+
+out_with_all:
+	lunix_all_destroy();
 
 out_with_sensors:
-	debug("at out_with_sensors\n");
-	for (; si_done >= 0; si_done--)
-		lunix_sensor_destroy(&lunix_sensors[si_done]);
-	kfree(lunix_sensors);
+	lunix_sensors_destroy();
 
 out:
 	debug("at out\n");
@@ -91,16 +102,13 @@ out:
 
 void __exit lunix_module_cleanup(void)
 {
-	int si_done;
-	
-	debug("entering, destroying chrdev and ldisc\n");
-	lunix_chrdev_destroy();
+	debug("entering, destroying ldisc and chrdev\n");
 	lunix_ldisc_destroy();
+	lunix_chrdev_destroy();
 	
 	debug("destroying sensor buffers\n");
-	for (si_done = lunix_sensor_cnt - 1; si_done >= 0; si_done--)
-		lunix_sensor_destroy(&lunix_sensors[si_done]);
-	kfree(lunix_sensors);
+	lunix_all_destroy();
+	lunix_sensors_destroy();
 
 	printk(KERN_INFO "Lunix:TNG module unloaded successfully\n");
 }
@@ -114,7 +122,11 @@ MODULE_AUTHOR("Vangelis Koukis");
 MODULE_LICENSE("GPL");
 
 module_param(lunix_sensor_cnt, int, 0);
-MODULE_PARM_DESC(lunix_sensor_cnt, "Maximum number of sensors to support");
+MODULE_PARM_DESC(lunix_sensor_cnt, "Maximum number of sensors [node ids] to support");
+module_param(lunix_history_depth, int, 0);
+MODULE_PARM_DESC(lunix_history_depth, "Number of samples kept per sensor [rounded up to a power of 2]");
+module_param(lunix_crc_check, int, 0644);
+MODULE_PARM_DESC(lunix_crc_check, "Drop packets with a bad CRC [default 1]");
 
 module_init(lunix_module_init);
 module_exit(lunix_module_cleanup);
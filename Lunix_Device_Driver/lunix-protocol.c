@@ -16,10 +16,51 @@
 
 #include <linux/kernel.h>
 #include <asm/byteorder.h>
+#include <asm/unaligned.h>
 
 #include "lunix.h"
 #include "lunix-protocol.h"
 
+/*
+ * CRC-16 of the packets, as computed by TinyOS: CCITT polynomial
+ * [x^16 + x^12 + x^5 + 1], most significant bit first, starting from 0.
+ * Table-driven, four bytes at a time [slice-by-4]: lunix_crc_table[k][b]
+ * is the CRC of byte b followed by k zero bytes.
+ */
+static uint16_t lunix_crc_table[4][256];
+
+static void lunix_crc_init(void)
+{
+	uint16_t crc;
+	int b, k, bit;
+
+	for (b = 0; b < 256; b++) {
+		crc = b << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		lunix_crc_table[0][b] = crc;
+	}
+	for (k = 1; k < 4; k++)
+		for (b = 0; b < 256; b++) {
+			crc = lunix_crc_table[k - 1][b];
+			lunix_crc_table[k][b] = (crc << 8) ^ lunix_crc_table[0][crc >> 8];
+		}
+}
+
+static uint16_t lunix_crc16(const unsigned char *p, int len)
+{
+	uint16_t crc = 0;
+
+	for (; len >= 4; p += 4, len -= 4)
+		crc = lunix_crc_table[3][p[0] ^ (crc >> 8)] ^
+		      lunix_crc_table[2][p[1] ^ (crc & 0xFF)] ^
+		      lunix_crc_table[1][p[2]] ^
+		      lunix_crc_table[0][p[3]];
+	for (; len > 0; p++, len--)
+		crc = (crc << 8) ^ lunix_crc_table[0][p[0] ^ (crc >> 8)];
+	return crc;
+}
+
 /*
  * Returns an unsigned 16-bit integer in native byte-order from
  * two bytes in an XMesh packet, which is always little-endian
@@ -49,13 +90,12 @@ static inline void lunix_protocol_show_packet(struct lunix_protocol_state_struct
 }
 
 /*
- * Receives a complete XMesh packet and updates the node structures if
- * the packet contains sensor information. The function ignores other
- * types of packets. In future releases check packets with packet[4]
- * equal to 0x03, 0xFD for extending this function.
+ * Decoder for the sensor data packets [AM type 0x0B], updates the
+ * structure of the sensor the packet came from.
  */
-static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *state, struct lunix_sensor_struct *lunix_sensors)
+static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *state)
 {
+	struct lunix_sensor_struct *s;
 	uint16_t batt;
 	uint16_t temp;
 	uint16_t light;
@@ -63,23 +103,73 @@ static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *st
 
 	//debug("WHOLE PACKET\n");
 
-	if (0x0B == state->packet[PACKET_SIGNATURE_OFFSET])
-	{
-		nodeid = uint16_from_packet(&state->packet[NODE_OFFSET]);
-		batt = uint16_from_packet(&state->packet[VREF_OFFSET]);
-		temp = uint16_from_packet(&state->packet[TEMPERATURE_OFFSET]);
-		light = uint16_from_packet(&state->packet[LIGHT_OFFSET]);
+	nodeid = uint16_from_packet(&state->packet[NODE_OFFSET]);
+	batt = uint16_from_packet(&state->packet[VREF_OFFSET]);
+	temp = uint16_from_packet(&state->packet[TEMPERATURE_OFFSET]);
+	light = uint16_from_packet(&state->packet[LIGHT_OFFSET]);
 
-		/* FIXME */
-		//debug ("I have the following raw data from nodeid = %d: { batt, temp, light } = { 0x%04x, 0x%04x, 0x%04x }\n",
-		//	nodeid, batt, temp, light);
+	/* FIXME */
+	//debug ("I have the following raw data from nodeid = %d: { batt, temp, light } = { 0x%04x, 0x%04x, 0x%04x }\n",
+	//	nodeid, batt, temp, light);
 
-		if (nodeid > 0 && nodeid <= lunix_sensor_cnt)
-			lunix_sensor_update(&lunix_sensors[nodeid - 1], batt, temp, light);
-		else
-			printk(KERN_WARNING "Node id %d is out of bounds [maximum %d sensors]\n",
-				nodeid, lunix_sensor_cnt);
+	if (nodeid == 0 || nodeid > lunix_sensor_cnt) {
+		printk(KERN_WARNING "Node id %d is out of bounds [maximum %d sensors]\n",
+			nodeid, lunix_sensor_cnt);
+		return;
 	}
+
+	/* The first packet of a node brings its sensor to life */
+	s = lunix_sensor_get(nodeid - 1, GFP_ATOMIC);
+	if (s)
+		lunix_sensor_update(s, batt, temp, light);
+	else
+		printk_ratelimited(KERN_WARNING "No memory for the sensor of node id %d, packet dropped\n",
+			nodeid);
+}
+
+static const struct lunix_protocol_decoder lunix_protocol_sensor_decoder = {
+	.min_payload_length =	LIGHT_OFFSET + 2 - PAYLOAD_OFFSET,
+	.decode =		lunix_protocol_update_sensors
+};
+
+/*
+ * The decoders of the packets, indexed by AM type. Packets of a type
+ * without a decoder [e.g. 0x03, 0xFD, route and health information]
+ * are received and checked, then ignored.
+ */
+static const struct lunix_protocol_decoder *lunix_protocol_decoders[256];
+
+/*
+ * Registers the decoder for the packets of an AM type. This is the hook
+ * for the rest of the module, it is not exported: new packet types are
+ * registered from lunix_module_init(), after lunix_protocol_init() and
+ * before the line discipline starts feeding packets to the state machine.
+ * Returns -EBUSY if the type already has a decoder, -EINVAL if the
+ * decoder could never get a packet that fits in the buffer.
+ */
+int lunix_protocol_register(unsigned char am_type, const struct lunix_protocol_decoder *dec)
+{
+	if (!dec->decode || dec->min_payload_length < 0 ||
+	    PAYLOAD_OFFSET + dec->min_payload_length + 3 > MAX_PACKET_LEN)
+		return -EINVAL;
+	if (lunix_protocol_decoders[am_type])
+		return -EBUSY;
+
+	lunix_protocol_decoders[am_type] = dec;
+	return 0;
+}
+
+/*
+ * Receives a complete XMesh packet and hands it
+ * to the decoder for its AM type, if any
+ */
+static void lunix_protocol_dispatch(struct lunix_protocol_state_struct *state)
+{
+	const struct lunix_protocol_decoder *dec;
+
+	dec = lunix_protocol_decoders[state->packet[PACKET_SIGNATURE_OFFSET]];
+	if (dec)
+		dec->decode(state);
 }
 
 /**********************************************************************************
@@ -110,15 +200,91 @@ static inline void set_state(struct lunix_protocol_state_struct *statep, int sta
 }
 
 /*
- * Initialization of protocol state machine
+ * Drops whatever has been received of the current packet
+ * and starts looking for the next one
  */
-void lunix_protocol_init(struct lunix_protocol_state_struct *state)
+static void lunix_protocol_reset(struct lunix_protocol_state_struct *state)
 {
 	state->pos = 0;
 	state->next_is_special = 0;
 	set_state(state, SEEKING_START_BYTE, 1, 0);
 }
 
+/*
+ * Called on a framing error [a start byte in the middle of a packet,
+ * a bogus payload length, a missing end byte]. The packet is lost,
+ * but the state machine picks up again from the next start byte.
+ */
+static int lunix_protocol_resync(struct lunix_protocol_state_struct *state)
+{
+	debug("framing error in state %d at pos = %d, resyncing\n", state->state, state->pos);
+	lunix_protocol_show_packet(state);
+	state->framing_errors++;
+	lunix_protocol_reset(state);
+	return -1;
+}
+
+/*
+ * Checks the payload length of a packet against its AM type, before
+ * its payload is read: it has to fit in the packet buffer, and be long
+ * enough for the decoder of its type.
+ */
+static int lunix_protocol_length_ok(struct lunix_protocol_state_struct *state, int payload_length)
+{
+	const struct lunix_protocol_decoder *dec;
+
+	if (PAYLOAD_OFFSET + payload_length + 3 > MAX_PACKET_LEN)
+		return 0;
+	dec = lunix_protocol_decoders[state->packet[PACKET_SIGNATURE_OFFSET]];
+	if (dec && payload_length < dec->min_payload_length)
+		return 0;
+	return 1;
+}
+
+/*
+ * Initialization of protocol state machine, and of the decoders,
+ * starting over with the one for sensor data
+ */
+int lunix_protocol_init(struct lunix_protocol_state_struct *state)
+{
+	int ret;
+
+	lunix_crc_init();
+	state->packets = 0;
+	state->crc_errors = 0;
+	state->framing_errors = 0;
+	lunix_protocol_reset(state);
+
+	memset(lunix_protocol_decoders, 0, sizeof(lunix_protocol_decoders));
+	ret = lunix_protocol_register(AM_TYPE_SENSOR_DATA, &lunix_protocol_sensor_decoder);
+	if (ret < 0)
+		printk(KERN_ERR "Failed to register the sensor data decoder, ret = %d\n", ret);
+	return ret;
+}
+
+/*
+ * Returns the length of the longest prefix of p[0..n) without any
+ * framing [0x7E] or escape [0x7D] bytes. Scans a word at a time: a word
+ * holds neither byte if neither XOR with it has a zero byte.
+ */
+static int lunix_protocol_plain_run(const unsigned char *p, int n)
+{
+	const unsigned long ones = REPEAT_BYTE(0x01), highs = REPEAT_BYTE(0x80);
+	unsigned long w, x, y;
+	int k;
+
+	for (k = 0; k + (int)sizeof(w) <= n; k += sizeof(w)) {
+		w = get_unaligned((const unsigned long *)(p + k));
+		x = w ^ REPEAT_BYTE(0x7E);
+		y = w ^ REPEAT_BYTE(0x7D);
+		if (((x - ones) & ~x & highs) | ((y - ones) & ~y & highs))
+			break;
+	}
+	while (k < n && p[k] != 0x7E && p[k] != 0x7D)
+		k++;
+	return k;
+}
+
 /*
  * Crucial function for parsing the input packet according
  * to the current state.
@@ -129,11 +295,16 @@ void lunix_protocol_init(struct lunix_protocol_state_struct *state)
  * int *i: the pointer to the data received is updated when data are
  *         transferred to the unparsed_packet array
  * int use_specials: if 1 special characters are treated acc
+ *
+ * Returns 1 when the current field is complete, 0 when more data are
+ * needed and -1 on a framing error, after resetting the state machine.
+ * An unescaped 0x7E can only be a start byte, so it is left in the
+ * buffer for the next packet to begin with.
  */
 static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
 	const unsigned char *data, int length, int *i, int use_specials)
 {
-	int iter;
+	int iter, run;
 
 	//debug("entering, for *i = %d, length = %d, state = %d, btr = %d, br = %d, next_is_special = %d\n",
 	//	*i, length, state->state, state->bytes_to_read, state->bytes_read, state->next_is_special);
@@ -147,23 +318,39 @@ static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
 			return -1;
 		}
 #endif
-		/* Prevent buffer overflows */
-		if (state->pos == MAX_PACKET_LEN) {
-			printk(KERN_ERR "WARNING: state->pos == %d, MAX_PACKET_LEN is %d,"
-				"packet buffer would overflow!\n", state->pos, MAX_PACKET_LEN);
-			printk(KERN_ERR "How will I ever resync with the input stream?\n");
-			state->pos = 0;
-			return -1;
+		/*
+		 * Prevent buffer overflows, cannot happen
+		 * once the payload length has been checked
+		 */
+		if (state->pos == MAX_PACKET_LEN)
+			return lunix_protocol_resync(state);
+
+		/*
+		 * Fast path: copy the whole run of plain bytes up to the
+		 * next special character, the end of the field or of the
+		 * buffer in one go, leave the rest to the code below.
+		 */
+		if (1 == use_specials && !state->next_is_special) {
+			run = min3(length - *i, state->bytes_to_read - state->bytes_read,
+				MAX_PACKET_LEN - state->pos);
+			run = lunix_protocol_plain_run(&data[*i], run);
+			if (run > 0) {
+				memcpy(&state->packet[state->pos], &data[*i], run);
+				state->pos += run;
+				state->bytes_read += run;
+				*i += run;
+				continue;
+			}
 		}
 
 		if (1 == use_specials)
 		{
+			if (0x7E == data[*i])
+				return lunix_protocol_resync(state);
+
 			if (state->next_is_special)
 			{
-				if (0x7E == state->next_is_special)
-					state->packet[state->pos] = data[*i];
-				if (0x7D == state->next_is_special)
-					state->packet[state->pos] = data[*i]^0x20;
+				state->packet[state->pos] = data[*i]^0x20;
 				++state->pos;
 				++state->bytes_read;
 				++(*i);
@@ -171,7 +358,7 @@ static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
 			}
 			else
 			{
-				if ((0x7E == data[*i]) || (0x7D == data[*i]))
+				if (0x7D == data[*i])
 				{
 					state->next_is_special = data[*i];
 					++(*i);
@@ -203,9 +390,23 @@ static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
 	return 0;
 }
 
+/*
+ * Checks the CRC of a complete packet, which covers everything
+ * from the packet type up to the CRC itself, little-endian
+ */
+static int lunix_protocol_crc_ok(struct lunix_protocol_state_struct *state)
+{
+	int crc_pos = state->pos - 3;
+
+	return lunix_crc16(&state->packet[1], crc_pos - 1) ==
+		uint16_from_packet(&state->packet[crc_pos]);
+}
+
 /*
  * This function gets called for incoming data
- * to update the protocol state machine.
+ * to update the protocol state machine. The TTY layer may hand us
+ * any number of packets, or parts of them, at once: keep running
+ * the state machine until the whole buffer has been consumed.
  */
 
 int lunix_protocol_received_buf(struct lunix_protocol_state_struct *state,
@@ -213,53 +414,80 @@ int lunix_protocol_received_buf(struct lunix_protocol_state_struct *state,
 {
 	int i;
 	int payload_length;
+	const unsigned char *start;
 
 	i = 0;
 
-	if (state->state == SEEKING_START_BYTE)
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_PACKET_TYPE, 1, 0);
-
-
-	if (state->state == SEEKING_PACKET_TYPE)
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_DESTINATION_ADDRESS, 2, 0);
-
-	if (state->state == SEEKING_DESTINATION_ADDRESS)
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_TYPE, 1, 0);
-
-	if (state->state == SEEKING_AM_TYPE)
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_AM_GROUP, 1, 0);
+	while (i < length) {
+		if (state->state == SEEKING_START_BYTE) {
+			/* Skip any line noise up to the next start byte */
+			start = memchr(&buf[i], 0x7E, length - i);
+			if (!start)
+				break;
+			i = start - buf;
+			if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
+				set_state(state, SEEKING_PACKET_TYPE, 1, 0);
+		}
 
-	if (state->state == SEEKING_AM_GROUP)
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_PAYLOAD_LENGTH, 1, 0);
+		if (state->state == SEEKING_PACKET_TYPE)
+			if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
+				/*
+				 * Two 0x7E in a row, after a resync: the first
+				 * one was the end of a lost packet, this one
+				 * starts the next packet.
+				 */
+				if (0x7E == state->packet[state->pos - 1]) {
+					state->pos--;
+					set_state(state, SEEKING_PACKET_TYPE, 1, 0);
+				} else
+					set_state(state, SEEKING_DESTINATION_ADDRESS, 2, 0);
+			}
 
-	if (state->state == SEEKING_PAYLOAD_LENGTH)
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1) {
-			payload_length = state->packet[state->pos - 1];
-			set_state(state, SEEKING_PAYLOAD, payload_length, 0);
-		}
+		if (state->state == SEEKING_DESTINATION_ADDRESS)
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_AM_TYPE, 1, 0);
+
+		if (state->state == SEEKING_AM_TYPE)
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_AM_GROUP, 1, 0);
+
+		if (state->state == SEEKING_AM_GROUP)
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_PAYLOAD_LENGTH, 1, 0);
+
+		if (state->state == SEEKING_PAYLOAD_LENGTH)
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1) {
+				payload_length = state->packet[state->pos - 1];
+				if (lunix_protocol_length_ok(state, payload_length))
+					set_state(state, SEEKING_PAYLOAD, payload_length, 0);
+				else
+					lunix_protocol_resync(state);
+			}
 
-	if (state->state == SEEKING_PAYLOAD)
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_CRC, 2, 0);
+		if (state->state == SEEKING_PAYLOAD)
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_CRC, 2, 0);
 
-	if (state->state == SEEKING_CRC)
-		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
-			set_state(state, SEEKING_END_BYTE, 1, 0);
+		if (state->state == SEEKING_CRC)
+			if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
+				set_state(state, SEEKING_END_BYTE, 1, 0);
 
-	if (state->state == SEEKING_END_BYTE)
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
-			//debug("An XMesh packet has been received, updating sensors\n");
+		if (state->state == SEEKING_END_BYTE)
+			if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
+				//debug("An XMesh packet has been received, updating sensors\n");
 
-			lunix_protocol_update_sensors(state, lunix_sensors);
-			state->pos = 0;
-			state->next_is_special = 0;
-			set_state(state, SEEKING_START_BYTE, 1, 0);
-		}
+				if (0x7E != state->packet[state->pos - 1]) {
+					lunix_protocol_resync(state);
+					continue;
+				}
+				state->packets++;
+				if (!lunix_crc_check || lunix_protocol_crc_ok(state))
+					lunix_protocol_dispatch(state);
+				else
+					state->crc_errors++;
+				lunix_protocol_reset(state);
+			}
+	}
 
 	//debug("leaving\n");
 
@@ -20,11 +20,17 @@
  */
 #define MAX_PACKET_LEN 300
 #define PACKET_SIGNATURE_OFFSET 4
+#define PAYLOAD_OFFSET 7
 #define NODE_OFFSET 9
 #define VREF_OFFSET 18
 #define TEMPERATURE_OFFSET 20
 #define LIGHT_OFFSET 22
 
+/*
+ * AM types of XMesh packets
+ */
+#define AM_TYPE_SENSOR_DATA 0x0B
+
 /*
  * States of the Lunix protocol state machine
  */
@@ -51,12 +57,36 @@ struct lunix_protocol_state_struct
 	unsigned char next_is_special;  /* The next character to be received is a special character */
 	unsigned char payload_length;   /* The length of the payload of the received packet */
 	unsigned char packet[MAX_PACKET_LEN]; /* The XMesh packet being received */
+
+	/* Statistics, see struct lunix_chrdev_stats */
+	unsigned long packets;          /* Complete packets received */
+	unsigned long crc_errors;       /* Packets dropped because of a bad CRC */
+	unsigned long framing_errors;   /* Packets dropped because of a framing error */
 };
 
+/*
+ * A decoder for the XMesh packets of one AM type. It is called from
+ * the line discipline, in atomic context, with every complete packet
+ * of its type that passed the CRC check, and extracts its fields
+ * directly from state->packet. Packets whose payload is shorter than
+ * min_payload_length are dropped as framing errors, before the decoder
+ * ever sees them.
+ */
+struct lunix_protocol_decoder {
+	int min_payload_length;
+	void (*decode)(struct lunix_protocol_state_struct *);
+};
+
+/*
+ * Whether to drop packets with a bad CRC, a module parameter
+ */
+extern int lunix_crc_check;
+
 /*
  * Function prototypes
  */
-void lunix_protocol_init(struct lunix_protocol_state_struct *);
+int lunix_protocol_init(struct lunix_protocol_state_struct *);
+int lunix_protocol_register(unsigned char am_type, const struct lunix_protocol_decoder *);
 int lunix_protocol_received_buf(struct lunix_protocol_state_struct *, const unsigned char *buf, int count);
 
 #endif	/* __KERNEL__ */
@@ -10,6 +10,7 @@
 
 #include <linux/mm.h>
 #include <linux/fs.h>
+#include <linux/idr.h>
 #include <linux/init.h>
 #include <linux/list.h>
 #include <linux/poll.h>
@@ -21,76 +22,476 @@
 #include <linux/kernel.h>
 #include <linux/mmzone.h>
 #include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
 #include <linux/spinlock.h>
+#include <linux/timekeeping.h>
 
 #include "lunix.h"
+#include "lunix-chrdev.h"
+
+/*
+ * The sensors allocated so far. Insertions are serialized
+ * by lunix_sensors_lock, lookups are lockless.
+ */
+DEFINE_IDR(lunix_sensors);
+static DEFINE_SPINLOCK(lunix_sensors_lock);
+
+/*
+ * The measurement records of all sensors, packed into shared pages, each
+ * one on a cache line of its own, so that an update touches a single line.
+ * Pages are allocated as sensors show up, sensor number id lives in page
+ * id / LUNIX_MSR_PER_PAGE. They are installed under lunix_sensors_lock.
+ */
+#define LUNIX_MSR_SIZE		L1_CACHE_ALIGN(sizeof(struct lunix_msr_data_struct) + \
+					N_LUNIX_MSR * sizeof(uint32_t))
+#define LUNIX_MSR_PER_PAGE	(PAGE_SIZE / LUNIX_MSR_SIZE)
+
+static unsigned long *lunix_msr_pages;
+static int lunix_msr_page_cnt;
+
+static struct lunix_msr_data_struct *lunix_msr_alloc(int id, gfp_t gfp)
+{
+	unsigned long *page = &lunix_msr_pages[id / LUNIX_MSR_PER_PAGE];
+	struct lunix_msr_data_struct *msr;
+	unsigned long p, flags;
+
+	if (!READ_ONCE(*page)) {
+		p = get_zeroed_page(gfp);
+		if (!p)
+			return NULL;
+
+		spin_lock_irqsave(&lunix_sensors_lock, flags);
+		if (!*page) {
+			*page = p;
+			p = 0;
+		}
+		spin_unlock_irqrestore(&lunix_sensors_lock, flags);
+
+		/* Another sensor of the page beat us to it */
+		if (p)
+			free_page(p);
+	}
+
+	msr = (struct lunix_msr_data_struct *)(*page + id % LUNIX_MSR_PER_PAGE * LUNIX_MSR_SIZE);
+	msr->magic = LUNIX_MSR_MAGIC;
+	return msr;
+}
+
+/*
+ * The aggregate history of all sensors. Its writers
+ * are serialized by lunix_all_lock.
+ */
+struct lunix_hist_struct lunix_all_hist;
+wait_queue_head_t lunix_all_wq;
+static DEFINE_SPINLOCK(lunix_all_lock);
+
+int lunix_line_attached;
+atomic_t lunix_detach_cnt = ATOMIC_INIT(0);
+
+/*
+ * Allocates the history ring of a sensor, if it does not have one yet.
+ * A deep ring is too large to ask for in atomic context, the line
+ * discipline drops the samples of the sensor until it is there.
+ */
+static int lunix_sensor_hist_alloc(struct lunix_sensor_struct *s)
+{
+	struct lunix_sample_struct *samples;
+	unsigned long flags;
+
+	if (READ_ONCE(s->hist.samples))
+		return 0;
+
+	samples = kvcalloc(lunix_history_depth, sizeof(*samples), GFP_KERNEL);
+	if (!samples)
+		return -ENOMEM;
+
+	/* Readers only look at it once hist.head has moved */
+	spin_lock_irqsave(&s->lock, flags);
+	if (!s->hist.samples) {
+		s->hist.samples = samples;
+		samples = NULL;
+	}
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	kvfree(samples);
+	return 0;
+}
+
+static void lunix_sensor_setup(struct work_struct *work)
+{
+	struct lunix_sensor_struct *s;
+
+	s = container_of(work, struct lunix_sensor_struct, setup_work);
+	if (lunix_sensor_hist_alloc(s) < 0)
+		printk(KERN_WARNING "No memory for the history of sensor %d, "
+			"keeping none until it is opened\n", s->id);
+	lunix_chrdev_sensor_added(s);
+}
 
 /*
  * Initialization and destruction of sensor structures
  */
-int lunix_sensor_init(struct lunix_sensor_struct *s)
+int lunix_sensor_init(struct lunix_sensor_struct *s, gfp_t gfp)
 {
-	int i;
 	int ret;
-	unsigned long p;
 
 	/*
 	 * Initialize structure fields
 	 */
 	spin_lock_init(&s->lock);
-	init_waitqueue_head(&s->wq);
+	s->seq = 0;
+	INIT_LIST_HEAD(&s->subs);
+	INIT_WORK(&s->setup_work, lunix_sensor_setup);
 
 	/*
-	 * Allocate one page per measurement buffer
+	 * Allocate the history ring, unless in atomic context
 	 */
-	for (i = 0; i < N_LUNIX_MSR; i++)
-		s->msr_data[i] = NULL;
+	s->hist.head = 0;
+	s->hist.mask = lunix_history_depth - 1;
+	s->hist.samples = NULL;
 
-	for (i = 0; i < N_LUNIX_MSR; i++) {
-		p = get_zeroed_page(GFP_KERNEL);
-		if (!p) {
-			ret = -ENOMEM;
-			goto out;
-		}
-		s->msr_data[i] = (struct lunix_msr_data_struct *)p;
-		s->msr_data[i]->magic = LUNIX_MSR_MAGIC;
+	if (gfpflags_allow_blocking(gfp) && lunix_sensor_hist_alloc(s) < 0) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/*
+	 * Find the measurement record of the sensor, in a shared page
+	 */
+	s->msr = lunix_msr_alloc(s->id, gfp);
+	if (!s->msr) {
+		ret = -ENOMEM;
+		goto out;
 	}
 
 	ret = 0;
 out:
+	if (ret < 0)
+		lunix_sensor_destroy(s);
 	return ret;
 }
 
+/* The measurement record is freed along with its page, by lunix_sensors_destroy() */
 void lunix_sensor_destroy(struct lunix_sensor_struct *s)
 {
-	int i;
+	kvfree(s->hist.samples);
+}
+
+/*
+ * Looks up a sensor, without allocating it. Sensors are never freed
+ * before the module is unloaded, so the result stays valid.
+ */
+struct lunix_sensor_struct *lunix_sensor_find(int id)
+{
+	struct lunix_sensor_struct *s;
+
+	rcu_read_lock();
+	s = idr_find(&lunix_sensors, id);
+	rcu_read_unlock();
+	return s;
+}
+
+/*
+ * Looks up a sensor, allocating it on first use. Called with GFP_ATOMIC
+ * by the line discipline, with GFP_KERNEL on open(), which also makes
+ * sure the sensor has its history ring. Returns NULL if out of memory.
+ */
+struct lunix_sensor_struct *lunix_sensor_get(int id, gfp_t gfp)
+{
+	struct lunix_sensor_struct *s, *old;
+	unsigned long flags;
+	int ret = 0;
+
+	s = lunix_sensor_find(id);
+	if (likely(s)) {
+		if (gfpflags_allow_blocking(gfp) && lunix_sensor_hist_alloc(s) < 0)
+			return NULL;
+		return s;
+	}
+
+	s = kzalloc(sizeof(*s), gfp);
+	if (!s)
+		return NULL;
+	s->id = id;
+	if (lunix_sensor_init(s, gfp) < 0) {
+		kfree(s);
+		return NULL;
+	}
+
+	/* The index nodes are small, allocate them under the lock */
+	spin_lock_irqsave(&lunix_sensors_lock, flags);
+	old = idr_find(&lunix_sensors, id);
+	if (!old)
+		ret = idr_alloc(&lunix_sensors, s, id, id + 1, GFP_ATOMIC);
+	spin_unlock_irqrestore(&lunix_sensors_lock, flags);
+
+	/* Somebody else may have beaten us to it */
+	if (old || ret < 0) {
+		lunix_sensor_destroy(s);
+		kfree(s);
+		return old;
+	}
+
+	debug("allocated sensor %d\n", id);
+	schedule_work(&s->setup_work);
+	return s;
+}
+
+/*
+ * Sets up the table of measurement record pages, for as many sensors as
+ * lunix_sensor_cnt. The pages themselves are allocated on demand.
+ */
+int lunix_sensors_init(void)
+{
+	lunix_msr_page_cnt = DIV_ROUND_UP(lunix_sensor_cnt, LUNIX_MSR_PER_PAGE);
+	lunix_msr_pages = kcalloc(lunix_msr_page_cnt, sizeof(*lunix_msr_pages), GFP_KERNEL);
+
+	return lunix_msr_pages ? 0 : -ENOMEM;
+}
+
+/*
+ * Frees all sensors, on module unload
+ */
+void lunix_sensors_destroy(void)
+{
+	struct lunix_sensor_struct *s;
+	int id, i;
+
+	idr_for_each_entry(&lunix_sensors, s, id) {
+		lunix_sensor_destroy(s);
+		kfree(s);
+	}
+	idr_destroy(&lunix_sensors);
 
-	for (i = 0; i < N_LUNIX_MSR; i++) {
-		if (s->msr_data[i])
-			free_page((unsigned long)s->msr_data[i]);
+	for (i = 0; i < lunix_msr_page_cnt; i++)
+		if (lunix_msr_pages[i])
+			free_page(lunix_msr_pages[i]);
+	kfree(lunix_msr_pages);
+}
+
+/*
+ * The aggregate history holds as many samples as the
+ * histories of LUNIX_SENSOR_CNT sensors together
+ */
+int lunix_all_init(void)
+{
+	unsigned long depth;
+
+	depth = roundup_pow_of_two((unsigned long)lunix_history_depth * LUNIX_SENSOR_CNT);
+	init_waitqueue_head(&lunix_all_wq);
+	lunix_all_hist.head = 0;
+	lunix_all_hist.mask = depth - 1;
+	lunix_all_hist.samples = vzalloc(depth * sizeof(*lunix_all_hist.samples));
+
+	return lunix_all_hist.samples ? 0 : -ENOMEM;
+}
+
+void lunix_all_destroy(void)
+{
+	vfree(lunix_all_hist.samples);
+}
+
+/*
+ * Adding and removing subscribers. Once lunix_sensor_unsubscribe()
+ * returns, the update callback is guaranteed not to be running.
+ */
+void lunix_sensor_subscribe(struct lunix_sensor_struct *s, struct lunix_sub_struct *sub)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&s->lock, flags);
+	list_add_tail(&sub->list, &s->subs);
+	spin_unlock_irqrestore(&s->lock, flags);
+}
+
+void lunix_sensor_unsubscribe(struct lunix_sensor_struct *s, struct lunix_sub_struct *sub)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&s->lock, flags);
+	list_del(&sub->list);
+	spin_unlock_irqrestore(&s->lock, flags);
+}
+
+/*
+ * Called by the line discipline when it is attached to a TTY.
+ * Until then, sleepers fail right away, see lunix_line_lost().
+ */
+void lunix_sensors_attach(void)
+{
+	WRITE_ONCE(lunix_line_attached, 1);
+}
+
+/*
+ * Called by the line discipline when it is detached from its TTY.
+ * Wakes up every sleeper, of any sensor, so that it gets an error
+ * instead of waiting for data that may never come.
+ */
+void lunix_sensors_detach(void)
+{
+	struct lunix_sensor_struct *s;
+	struct lunix_sub_struct *sub;
+	unsigned long flags;
+	int id;
+
+	WRITE_ONCE(lunix_line_attached, 0);
+	atomic_inc(&lunix_detach_cnt);
+	rcu_read_lock();
+	idr_for_each_entry(&lunix_sensors, s, id) {
+		spin_lock_irqsave(&s->lock, flags);
+		list_for_each_entry(sub, &s->subs, list)
+			if (sub->detach)
+				sub->detach(sub);
+		spin_unlock_irqrestore(&s->lock, flags);
 	}
+	rcu_read_unlock();
+	wake_up_interruptible_all(&lunix_all_wq);
+}
+
+/*
+ * Appends a sample to a history ring. Must be called
+ * with the sensor spinlock held.
+ */
+static void lunix_hist_push(struct lunix_hist_struct *h,
+	const struct lunix_sample_struct *smp)
+{
+	h->samples[h->head & h->mask] = *smp;
+	smp_wmb();
+	WRITE_ONCE(h->head, h->head + 1);
+}
+
+/*
+ * Copies up to n samples from a history ring, starting at *pos, and
+ * advances *pos past them. The slot of the oldest sample may be under
+ * rewrite at any time, so a reader that has fallen that far behind
+ * skips ahead to the depth - 1 most recent samples.
+ * Returns the number of samples copied. Never blocks the writer.
+ */
+int lunix_hist_read(struct lunix_hist_struct *h, uint32_t *pos,
+	struct lunix_sample_struct *buf, int n)
+{
+	uint32_t head, first, cnt, skip, i;
+
+	do {
+		head = smp_load_acquire(&h->head);
+		first = *pos;
+		if (head - first > h->mask)
+			first = head - h->mask;
+
+		cnt = min_t(uint32_t, head - first, n);
+		for (i = 0; i < cnt; i++)
+			buf[i] = h->samples[(first + i) & h->mask];
+
+		/*
+		 * The writer may have lapped us while copying: a sample is
+		 * only valid if it is still less than a full ring behind head.
+		 */
+		smp_rmb();
+		head = READ_ONCE(h->head);
+		if (head - first > h->mask) {
+			skip = min_t(uint32_t, head - first - h->mask, cnt);
+			memmove(buf, buf + skip, (cnt - skip) * sizeof(*buf));
+			first += skip;
+			cnt -= skip;
+		}
+
+		*pos = first + cnt;
+	} while (cnt == 0 && *pos != head);
+
+	return cnt;
+}
+
+/*
+ * Copies the most recent sample of a sensor from its measurement
+ * record, which, unlike the history ring, has been updated with every
+ * one of them. Returns -ENODATA if there is none yet.
+ */
+int lunix_sensor_latest(struct lunix_sensor_struct *s, struct lunix_sample_struct *smp)
+{
+	struct lunix_msr_data_struct *msr = s->msr;
+	uint32_t version;
+	int i;
+
+	do {
+		version = lunix_msr_read_begin(msr);
+		for (i = 0; i < N_LUNIX_MSR; i++)
+			smp->values[i] = msr->values[i];
+		smp->timestamp = msr->last_update;
+		smp->seq = msr->seq;
+	} while (lunix_msr_read_retry(msr, version));
+
+	smp->sensor = s->id;
+	return smp->seq ? 0 : -ENODATA;
+}
+
+/*
+ * Bump the version counter of a measurement record around an update,
+ * so that lockless readers [see lunix_msr_read_begin()] can detect
+ * that they raced with us and retry. Writers are serialized by the
+ * sensor spinlock.
+ */
+static inline void lunix_msr_write_begin(struct lunix_msr_data_struct *msr)
+{
+	WRITE_ONCE(msr->version, msr->version + 1);
+	smp_wmb();
+}
+
+static inline void lunix_msr_write_end(struct lunix_msr_data_struct *msr)
+{
+	smp_wmb();
+	WRITE_ONCE(msr->version, msr->version + 1);
+}
+
+static void lunix_msr_publish(struct lunix_msr_data_struct *msr,
+	const struct lunix_sample_struct *smp)
+{
+	int i;
+
+	lunix_msr_write_begin(msr);
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		msr->values[i] = smp->values[i];
+	msr->last_update = smp->timestamp;
+	msr->seq = smp->seq;
+	lunix_msr_write_end(msr);
 }
 
 void lunix_sensor_update(struct lunix_sensor_struct *s,
 	uint16_t batt, uint16_t temp, uint16_t light)
 {
+	struct lunix_sample_struct smp = {
+		.timestamp = ktime_get_ns(),
+		.sensor = s->id,
+		.values = { [BATT] = batt, [TEMP] = temp, [LIGHT] = light }
+	};
+	struct lunix_sub_struct *sub;
+
 	spin_lock(&s->lock);
-	
+
 	/*
-	 * Update the raw values and the relevant timestamps.
+	 * Update the raw values, the relevant timestamps
+	 * and sequence numbers. Bump the sequence number of the
+	 * sensor only once the record is there for waiters to read.
 	 */
-	s->msr_data[BATT]->values[0] = batt;
-	s->msr_data[TEMP]->values[0] = temp;
-	s->msr_data[LIGHT]->values[0] = light;
+	smp.seq = s->seq + 1;
+	lunix_msr_publish(s->msr, &smp);
+	WRITE_ONCE(s->seq, smp.seq);
 
-	s->msr_data[BATT]->magic = s->msr_data[TEMP]->magic = s->msr_data[LIGHT]->magic = LUNIX_MSR_MAGIC;
-	s->msr_data[BATT]->last_update = s->msr_data[TEMP]->last_update = s->msr_data[LIGHT]->last_update = get_seconds();
+	/* Only the history has to wait for lunix_sensor_hist_alloc() */
+	if (likely(s->hist.samples))
+		lunix_hist_push(&s->hist, &smp);
+
+	list_for_each_entry(sub, &s->subs, list)
+		sub->update(sub, &smp);
 	
 	spin_unlock(&s->lock);
 
+	spin_lock(&lunix_all_lock);
+	lunix_hist_push(&lunix_all_hist, &smp);
+	spin_unlock(&lunix_all_lock);
+
 	/*
-	 * And wake up any sleepers who may be waiting on
-	 * fresh data from this sensor.
+	 * Subscribers have already woken up any sleepers of their own,
+	 * wake up the ones waiting on fresh data from any sensor.
 	 */
-	wake_up_interruptible(&s->wq);
+	wake_up_interruptible(&lunix_all_wq);
 }
@@ -16,46 +16,151 @@
 #ifdef __KERNEL__ 
 
 #include <linux/fs.h>
+#include <linux/idr.h>
 #include <linux/tty.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/workqueue.h>
 
 /*
  * A structure representing a hardware sensor
- * and pages holding the most recent measurements received
+ * and a record holding the most recent measurements received
  */
 
 #define LUNIX_MSR_MAGIC 0xF00DF00D
 
 enum lunix_msr_enum { BATT = 0, TEMP, LIGHT, N_LUNIX_MSR };
+
+/*
+ * A timestamped sample of all measurements of a sensor,
+ * as received in a single packet. Since every packet updates
+ * all measurements, seq is also the sequence number of each one.
+ */
+struct lunix_sample_struct {
+	uint64_t timestamp;	/* CLOCK_MONOTONIC, in nanoseconds */
+	uint32_t seq;		/* Number of updates of the sensor so far */
+	uint16_t sensor;
+	uint16_t values[N_LUNIX_MSR];
+};
+
+/*
+ * A ring holding the most recent samples of a sensor.
+ * The line discipline is the only writer. Readers keep their own
+ * position [a free-running sample count, like head] and never lock.
+ * Samples received before the ring was allocated are not in it, so
+ * positions and sequence numbers need not match.
+ */
+struct lunix_hist_struct {
+	uint32_t head;		/* Number of samples pushed so far */
+	uint32_t mask;		/* Depth of the ring - 1, a power of two */
+	struct lunix_sample_struct *samples;
+};
+
+/*
+ * A subscriber to the updates of a sensor. The update callback runs
+ * in the context of the line discipline, with the sensor spinlock
+ * held, for every sample received. The detach callback, if any, runs
+ * the same way when the line discipline is detached from its TTY.
+ * They must not sleep.
+ */
+struct lunix_sub_struct {
+	struct list_head list;
+	void (*update)(struct lunix_sub_struct *sub,
+		const struct lunix_sample_struct *smp);
+	void (*detach)(struct lunix_sub_struct *sub);
+};
+
 struct lunix_sensor_struct {
+	/* The sensor number, its node id - 1 */
+	int id;
+
 	/*
-	 * A number of pages, one for each measurement.
-	 * They can be mapped to userspace.
+	 * The most recent measurements, on a cache line in a page
+	 * shared with other sensors. It can be mapped to userspace.
 	 */
-	struct lunix_msr_data_struct *msr_data[N_LUNIX_MSR];
+	struct lunix_msr_data_struct *msr;
 
 	/*
-	 * Spinlock used to assert mutual exclusion between
-	 * the serial line discipline and the character device driver
+	 * Spinlock serializing updates from the serial line discipline.
+	 * Readers never take it, they use the version counter of
+	 * the measurement record instead.
 	 */
 	spinlock_t lock;
 
+	/* The number of samples received so far, the last sequence number */
+	uint32_t seq;
+
+	/*
+	 * The most recent samples, so that late readers do not lose
+	 * any of them. The ring of a sensor that showed up in atomic
+	 * context is only allocated later, by setup_work.
+	 */
+	struct lunix_hist_struct hist;
+
 	/*
-	 * A list of processes waiting to be woken up
-	 * when this sensor has been updated with new data
+	 * Subscribers to be told about every sample, e.g., every open
+	 * file of the sensor, each one with its own wait queue, so
+	 * only the readers that will return data get woken up.
+	 * Protected by the sensor spinlock.
 	 */
-	wait_queue_head_t wq;
+	struct list_head subs;
+
+	/*
+	 * Finishes setting up a new sensor in process context: allocates
+	 * its history ring, if need be, and creates its device nodes
+	 */
+	struct work_struct setup_work;
 };
 
 /*
- * The default value for the maximum number of sensors supported
+ * The default and maximum value for the maximum number
+ * of sensors supported. Node ids are 16-bit, 0 is not used.
  */
 #define LUNIX_SENSOR_CNT			16
+#define LUNIX_SENSOR_MAX			65535
 extern int lunix_sensor_cnt;
-extern struct lunix_sensor_struct *lunix_sensors;
+
+/*
+ * Sensors are allocated on demand, on the first packet of their node
+ * or the first open() of one of their device nodes, and live as long
+ * as the module does. They are indexed by sensor number.
+ */
+extern struct idr lunix_sensors;
+
+/*
+ * The default and maximum number of samples kept per sensor
+ */
+#define LUNIX_HISTORY_DEPTH			64
+#define LUNIX_HISTORY_MAX			65536
+extern int lunix_history_depth;
 extern struct lunix_protocol_state_struct lunix_protocol_state;
 
+/*
+ * The samples of all sensors, in the order they were received,
+ * and the processes waiting for any sensor to be updated
+ */
+extern struct lunix_hist_struct lunix_all_hist;
+extern wait_queue_head_t lunix_all_wq;
+
+/*
+ * Whether the line discipline is attached to a TTY, and the number of
+ * times it has been detached, so that sleepers can tell there is no
+ * data coming, even if the line came back before they woke up
+ */
+extern int lunix_line_attached;
+extern atomic_t lunix_detach_cnt;
+
+static inline int lunix_line_down(void)
+{
+	return !READ_ONCE(lunix_line_attached);
+}
+
+static inline int lunix_line_lost(int detach_cnt)
+{
+	return lunix_line_down() ||
+		atomic_read(&lunix_detach_cnt) != detach_cnt;
+}
+
 /*
  * Debugging
  */
@@ -69,25 +174,86 @@ extern struct lunix_protocol_state_struct lunix_protocol_state;
 /*
  * Function prototypes
  */
-int lunix_sensor_init(struct lunix_sensor_struct *);
+int lunix_sensors_init(void);
+int lunix_sensor_init(struct lunix_sensor_struct *, gfp_t gfp);
 void lunix_sensor_destroy(struct lunix_sensor_struct *);
+struct lunix_sensor_struct *lunix_sensor_find(int id);
+struct lunix_sensor_struct *lunix_sensor_get(int id, gfp_t gfp);
+void lunix_sensors_destroy(void);
 void lunix_sensor_update(struct lunix_sensor_struct *s,
 	uint16_t batt, uint16_t temp, uint16_t light);
+int lunix_all_init(void);
+void lunix_all_destroy(void);
+void lunix_sensor_subscribe(struct lunix_sensor_struct *s, struct lunix_sub_struct *sub);
+void lunix_sensor_unsubscribe(struct lunix_sensor_struct *s, struct lunix_sub_struct *sub);
+void lunix_sensors_attach(void);
+void lunix_sensors_detach(void);
+int lunix_hist_read(struct lunix_hist_struct *h, uint32_t *pos,
+	struct lunix_sample_struct *buf, int n);
+int lunix_sensor_latest(struct lunix_sensor_struct *s, struct lunix_sample_struct *smp);
 
 #else
 #include <inttypes.h>
 #endif	/* __KERNEL__ */
 /*
- * A structure, living at the start of a page, containing a version number
- * [timestamp of last update] and a variable number of 32-bit quantities. It is
- * meant to be mappable to userspace.
+ * A structure, on a cache line of its own, containing a version counter,
+ * the [CLOCK_MONOTONIC, nanosecond] timestamp and the sequence number of
+ * the last update, and the raw measurements of a sensor, indexed by type
+ * [0: batt, 1: temp, 2: light]. The records of many sensors are packed
+ * into a page. mmap() on any character device node of a sensor maps the
+ * page holding its record read-only to userspace, the record itself is
+ * at the offset returned by the LUNIX_IOC_GET_MSR_OFFSET ioctl.
+ *
+ * The version counter is odd while the kernel is updating the record and is
+ * incremented again when it is done. To get a consistent snapshot, read the
+ * counter, then the data, then the counter again [with read barriers in
+ * between] and retry if the counter was odd or has changed.
  */
 struct lunix_msr_data_struct {
 	uint32_t magic;
-	uint32_t last_update;
+	uint32_t version;
+	uint64_t last_update;
+	uint32_t seq;
 	uint32_t values[];
 };
 
+/*
+ * Sequence counter protocol for lockless readers of a measurement record,
+ * shared by the character device driver and by userspace mappings:
+ *
+ *	do {
+ *		v = lunix_msr_read_begin(msr);
+ *		raw = msr->values[type];
+ *		...
+ *	} while (lunix_msr_read_retry(msr, v));
+ *
+ * Readers never block the line discipline, they just retry
+ * if they raced with an update.
+ */
+#ifdef __KERNEL__
+#define lunix_msr_rmb()		smp_rmb()
+#define lunix_msr_relax()	cpu_relax()
+#else
+#define lunix_msr_rmb()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define lunix_msr_relax()	do { } while (0)
+#endif
+
+static inline uint32_t lunix_msr_read_begin(const struct lunix_msr_data_struct *msr)
+{
+	uint32_t v;
+
+	while ((v = *(const volatile uint32_t *)&msr->version) & 1)
+		lunix_msr_relax();
+	lunix_msr_rmb();
+	return v;
+}
+
+static inline int lunix_msr_read_retry(const struct lunix_msr_data_struct *msr, uint32_t v)
+{
+	lunix_msr_rmb();
+	return *(const volatile uint32_t *)&msr->version != v;
+}
+
 /*
  * Lunix:TNG line discipline number:
  * Hijack the "Mobitex module" line discipline, since the number
@@ -4,9 +4,17 @@
 
 mknod /dev/ttyS0 c 4 64
 
-# Lunix:TNG nodes: 16 sensors, each has 3 nodes.
-for sensor in $(seq 0 1 15); do
+# Lunix:TNG nodes are created by the module itself, as sensors show up,
+# on systems with devtmpfs or udev. For a static /dev, pass the number
+# of sensors the module was loaded with [lunix_sensor_cnt, 16 by default].
+SENSORS=${1:-16}
+
+# Each sensor has 3 nodes.
+for sensor in $(seq 0 1 $[$SENSORS - 1]); do
 	mknod /dev/lunix$sensor-batt c 60 $[$sensor * 8 + 0]
 	mknod /dev/lunix$sensor-temp c 60 $[$sensor * 8 + 1]
 	mknod /dev/lunix$sensor-light c 60 $[$sensor * 8 + 2]
 done
+
+# The aggregate node, right after the last sensor.
+mknod /dev/lunix-all c 60 $[$SENSORS * 8]
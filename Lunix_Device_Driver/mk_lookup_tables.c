@@ -12,8 +12,21 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <inttypes.h>
 
+/*
+ * Size of each pre-rendered textual value, including its length byte
+ */
+#define TEXT_SLOT_SIZE 16
+
+/*
+ * The sensors have a 10-bit ADC, so raw measurements never exceed
+ * its full scale [ADC_FS below]. Only that range gets tabulated,
+ * the kernel has a fallback for anything beyond it.
+ */
+#define LOOKUP_SIZE 1024
+
 /*
  * Translates the received uint16_t value to voltage level
  */
@@ -66,6 +79,35 @@ long uint16_to_temp(uint16_t value)
 	return (l < -272150) ?  -272150 : l;
 }
 
+/*
+ * Renders a value in thousandths the way the character device reports it,
+ * e.g., -0.5 as "-0.500\n". Returns the length of the text.
+ */
+int render_value(char *buf, long l)
+{
+	return sprintf(buf, "%s%ld.%03ld\n", (l < 0) ? "-" : "", labs(l) / 1000, labs(l) % 1000);
+}
+
+/*
+ * Emits a table with the pre-rendered text of every raw value in range,
+ * so that formatting on the read path is just a bounded copy
+ */
+void print_text_table(const char *name, long (*conv)(uint16_t))
+{
+	char buf[TEXT_SLOT_SIZE];
+	unsigned int i;
+	int len;
+
+	fprintf(stdout, "const struct lunix_lookup_text %s[LUNIX_LOOKUP_SIZE] = {\n", name);
+	for (i = 0; i < LOOKUP_SIZE; i++) {
+		len = render_value(buf, conv(i));
+		/* Leave out the newline, it is emitted escaped */
+		fprintf(stdout, "\t{ %d, \"%.*s\\n\" }%s\n", len, len - 1, buf,
+			(i != LOOKUP_SIZE - 1) ? "," : "");
+	}
+	fprintf(stdout, "};\n\n");
+}
+
 int main(void)
 {
 	unsigned int i;
@@ -78,48 +120,64 @@ int main(void)
 		" * See %s instead.\n"
 		" *\n"
 		" * Instead of doing floating-point in kernelspace,\n"
-		" * use the following lookup tables to convert 16-bit\n"
-		" * raw measurements to floating point values.\n"
+		" * use the following lookup tables to convert raw\n"
+		" * measurements up to the ADC full scale to fixed-point\n"
+		" * values, in thousandths.\n"
+		" * The *_text tables hold the same values, rendered\n"
+		" * as text the way the character device reports them.\n"
 		" */\n"
 		"\n"
-		"long lookup_temperature[65536] = {\n", __FILE__);
+		"#define LUNIX_LOOKUP_SIZE %d\n"
+		"#define LUNIX_LOOKUP_TEXTSZ %d\n"
+		"\n"
+		"struct lunix_lookup_text {\n"
+		"\tunsigned char len;\n"
+		"\tunsigned char data[LUNIX_LOOKUP_TEXTSZ - 1];\n"
+		"};\n"
+		"\n"
+		"const int32_t lookup_temperature[LUNIX_LOOKUP_SIZE] = {\n",
+		__FILE__, LOOKUP_SIZE, TEXT_SLOT_SIZE);
 
 	/*
 	 * Temperature
 	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
+	for (i = 0; i <= LOOKUP_SIZE - 4; i += 4) {
 		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
 			uint16_to_temp(i), uint16_to_temp(i+1),
 			uint16_to_temp(i+2), uint16_to_temp(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
+		fprintf(stdout, (i != LOOKUP_SIZE - 4) ? ",\n" : "\n");
 	}
 
 	fprintf(stdout, "};\n\n"
-		"long lookup_voltage[65536] = {\n");
+		"const int32_t lookup_voltage[LUNIX_LOOKUP_SIZE] = {\n");
 
 	/*
 	 * Battery Voltage
 	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
+	for (i = 0; i <= LOOKUP_SIZE - 4; i += 4) {
 		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
 			uint16_to_batt(i), uint16_to_batt(i+1),
 			uint16_to_batt(i+2), uint16_to_batt(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
+		fprintf(stdout, (i != LOOKUP_SIZE - 4) ? ",\n" : "\n");
 	}
 	fprintf(stdout, "};\n\n"
-		"long lookup_light[65536] = {\n");
+		"const int32_t lookup_light[LUNIX_LOOKUP_SIZE] = {\n");
 
 	/*
 	 * Light
 	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
+	for (i = 0; i <= LOOKUP_SIZE - 4; i += 4) {
 		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
 			uint16_to_light(i), uint16_to_light(i+1),
 			uint16_to_light(i+2), uint16_to_light(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
+		fprintf(stdout, (i != LOOKUP_SIZE - 4) ? ",\n" : "\n");
 	}
 
 	fprintf(stdout, "};\n\n");
 
+	print_text_table("lookup_temperature_text", uint16_to_temp);
+	print_text_table("lookup_voltage_text", uint16_to_batt);
+	print_text_table("lookup_light_text", uint16_to_light);
+
 	return 0;
 }
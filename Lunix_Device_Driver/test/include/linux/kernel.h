@@ -0,0 +1,63 @@
+/*
+ * test/include/linux/kernel.h
+ *
+ * Userspace stand-ins for the few kernel interfaces used by
+ * lunix-protocol.c and the headers it includes, so that the
+ * protocol state machine can be tested without a kernel.
+ * The other headers under test/include just include this one.
+ */
+
+#ifndef _LUNIX_TEST_KERNEL_H
+#define _LUNIX_TEST_KERNEL_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef unsigned int gfp_t;
+#define GFP_KERNEL	0
+#define GFP_ATOMIC	1
+
+typedef struct { int counter; } atomic_t;
+typedef struct { int locked; } spinlock_t;
+typedef struct { int unused; } wait_queue_head_t;
+struct list_head { struct list_head *next, *prev; };
+struct work_struct { int unused; };
+struct idr { int unused; };
+
+#define likely(x)		(x)
+#define unlikely(x)		(x)
+#define READ_ONCE(x)		(x)
+#define WRITE_ONCE(x, v)	((x) = (v))
+#define atomic_read(v)		((v)->counter)
+#define smp_rmb()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define cpu_relax()		do { } while (0)
+
+#define KERN_DEBUG	""
+#define KERN_INFO	""
+#define KERN_WARNING	""
+#define KERN_ERR	""
+#define printk(...)		fprintf(stderr, __VA_ARGS__)
+#define printk_ratelimited(...)	fprintf(stderr, __VA_ARGS__)
+
+#define min(a, b)	((a) < (b) ? (a) : (b))
+#define min3(a, b, c)	min(min(a, b), c)
+#define REPEAT_BYTE(x)	((~0UL / 0xff) * (x))
+
+#define get_unaligned(p) ({				\
+	__typeof__(*(p) + 0) __v;			\
+	memcpy(&__v, (p), sizeof(__v));			\
+	__v;						\
+})
+
+static inline uint16_t le16_to_cpu(uint16_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return __builtin_bswap16(x);
+#else
+	return x;
+#endif
+}
+
+#endif	/* _LUNIX_TEST_KERNEL_H */
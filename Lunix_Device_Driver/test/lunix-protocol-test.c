@@ -0,0 +1,336 @@
+/*
+ * lunix-protocol-test.c
+ *
+ * Userspace tests for the protocol state machine of Lunix:TNG.
+ * lunix-protocol.c is built right into the test, against the stand-ins
+ * of test/include, and fed with generated captures of XMesh packets:
+ * many packets at once, split at every chunk size, with bad CRCs,
+ * with line noise and damaged framing, and of more than one AM type.
+ *
+ * Run with "make test".
+ */
+
+#include "lunix-protocol.c"
+
+#include <stdlib.h>
+
+/*
+ * Stand-ins for the sensor buffers: count the updates of each sensor,
+ * keep the last measurements received
+ */
+#define SENSORS 16
+
+int lunix_sensor_cnt = SENSORS;
+int lunix_crc_check = 1;
+
+static struct lunix_sensor_struct sensors[SENSORS];
+static int updates[SENSORS];
+static uint16_t last[SENSORS][N_LUNIX_MSR];
+
+struct lunix_sensor_struct *lunix_sensor_get(int id, gfp_t gfp)
+{
+	return &sensors[id];
+}
+
+void lunix_sensor_update(struct lunix_sensor_struct *s,
+	uint16_t batt, uint16_t temp, uint16_t light)
+{
+	int id = s - sensors;
+
+	updates[id]++;
+	last[id][BATT] = batt;
+	last[id][TEMP] = temp;
+	last[id][LIGHT] = light;
+}
+
+static int total_updates(void)
+{
+	int i, total = 0;
+
+	for (i = 0; i < SENSORS; i++)
+		total += updates[i];
+	return total;
+}
+
+/*
+ * Generating captures
+ */
+#define CAPTURE_SIZE	(1 << 20)
+
+static unsigned char cap[CAPTURE_SIZE];
+static struct lunix_protocol_state_struct state;
+
+/* CRC-16 of the packets, bit by bit, the way TinyOS computes it */
+static uint16_t crc16(const unsigned char *p, int len)
+{
+	uint16_t crc = 0;
+	int i, bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= p[i] << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+/*
+ * Builds an XMesh packet carrying sensor data, escaped and framed,
+ * with a bad CRC unless crc_ok. The destination address and the AM group
+ * need escaping, so every packet exercises it. Returns its length.
+ */
+static int mkpacket(unsigned char *out, int am_type, int node,
+	uint16_t batt, uint16_t temp, uint16_t light, int crc_ok)
+{
+	unsigned char raw[PAYLOAD_OFFSET + 20 + 2], *pl;
+	uint16_t crc;
+	int n = 0, o = 0, i;
+
+	raw[n++] = 0x42;		/* Packet type */
+	raw[n++] = 0x7E;		/* Destination address */
+	raw[n++] = 0x00;
+	raw[n++] = am_type;
+	raw[n++] = 0x7D;		/* AM group */
+	raw[n++] = 20;			/* Payload length */
+
+	pl = raw + n;
+	memset(pl, 0, 20);
+	pl[NODE_OFFSET - PAYLOAD_OFFSET] = node & 0xFF;
+	pl[NODE_OFFSET - PAYLOAD_OFFSET + 1] = node >> 8;
+	pl[VREF_OFFSET - PAYLOAD_OFFSET] = batt & 0xFF;
+	pl[VREF_OFFSET - PAYLOAD_OFFSET + 1] = batt >> 8;
+	pl[TEMPERATURE_OFFSET - PAYLOAD_OFFSET] = temp & 0xFF;
+	pl[TEMPERATURE_OFFSET - PAYLOAD_OFFSET + 1] = temp >> 8;
+	pl[LIGHT_OFFSET - PAYLOAD_OFFSET] = light & 0xFF;
+	pl[LIGHT_OFFSET - PAYLOAD_OFFSET + 1] = light >> 8;
+	n += 20;
+
+	crc = crc16(raw, n) ^ !crc_ok;
+	raw[n++] = crc & 0xFF;
+	raw[n++] = crc >> 8;
+
+	out[o++] = 0x7E;
+	for (i = 0; i < n; i++) {
+		if (raw[i] == 0x7E || raw[i] == 0x7D) {
+			out[o++] = 0x7D;
+			out[o++] = raw[i] ^ 0x20;
+		} else
+			out[o++] = raw[i];
+	}
+	out[o++] = 0x7E;
+	return o;
+}
+
+/* Feeds a capture to the state machine, chunk bytes at a time */
+static void feed(const unsigned char *p, int len, int chunk)
+{
+	int i;
+
+	for (i = 0; i < len; i += chunk)
+		lunix_protocol_received_buf(&state, p + i, min(chunk, len - i));
+}
+
+static int failures;
+
+#define CHECK(cond) do {							\
+	if (!(cond)) {								\
+		printf("FAIL: %s:%d: %s\n", __func__, __LINE__, #cond);		\
+		failures++;							\
+	}									\
+} while (0)
+
+static void reset(void)
+{
+	memset(updates, 0, sizeof(updates));
+	memset(last, 0, sizeof(last));
+	CHECK(lunix_protocol_init(&state) == 0);
+}
+
+/*
+ * A large capture of back to back packets, handed over in chunks of
+ * any size, must yield every single update, with the right values
+ */
+static void test_concatenated(void)
+{
+	static const int chunks[] = { 1, 2, 3, 7, 31, 64, 1000, CAPTURE_SIZE };
+	int c, i, n;
+
+	for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+		reset();
+		for (n = 0, i = 0; i < 1000; i++)
+			n += mkpacket(cap + n, 0x0B, 1 + i % SENSORS,
+				i, 0x7E7D ^ i, 0x1234 + i, 1);
+		feed(cap, n, chunks[c]);
+
+		CHECK(total_updates() == 1000);
+		CHECK(state.packets == 1000);
+		CHECK(last[999 % SENSORS][BATT] == 999);
+		CHECK(last[999 % SENSORS][TEMP] == (0x7E7D ^ 999));
+		CHECK(last[999 % SENSORS][LIGHT] == 0x1234 + 999);
+	}
+}
+
+/* Packets with a bad CRC are counted and dropped, unless the check is off */
+static void test_crc(void)
+{
+	int n;
+
+	n = mkpacket(cap, 0x0B, 3, 1, 2, 3, 0);
+	n += mkpacket(cap + n, 0x0B, 4, 1, 2, 3, 1);
+
+	reset();
+	feed(cap, n, n);
+	CHECK(updates[2] == 0 && updates[3] == 1);
+	CHECK(state.packets == 2 && state.crc_errors == 1);
+
+	reset();
+	lunix_crc_check = 0;
+	feed(cap, n, n);
+	lunix_crc_check = 1;
+	CHECK(updates[2] == 1 && updates[3] == 1);
+	CHECK(state.crc_errors == 0);
+}
+
+/*
+ * Damage to the framing of a packet, followed by some line noise,
+ * must cost that packet only: the state machine picks up again
+ * from the next start byte
+ */
+static void test_resync(void)
+{
+	static const unsigned char noise[] = { 0x11, 0x22, 0x7D, 0x33 };
+	static const int chunks[] = { 1, 5, CAPTURE_SIZE };
+	int kind, c, n, k;
+
+	for (kind = 0; kind < 5; kind++) {
+		n = mkpacket(cap, 0x0B, 1, 1, 2, 3, 1);
+		k = n;
+		n += mkpacket(cap + n, 0x0B, 2, 1, 2, 3, 1);
+		switch (kind) {
+		case 0:		/* Payload length beyond the packet buffer */
+			cap[k + 6] = 250;
+			break;
+		case 1:		/* Payload too short for sensor data */
+			cap[k + 6] = 3;
+			break;
+		case 2:		/* Truncated, no end byte */
+			n = k + 12;
+			break;
+		case 3:		/* End byte garbled */
+			cap[n - 1] = 0x55;
+			break;
+		case 4:		/* A byte lost in the payload */
+			memmove(cap + k + 10, cap + k + 11, n - k - 11);
+			n--;
+			break;
+		}
+		memcpy(cap + n, noise, sizeof(noise));
+		n += sizeof(noise);
+		n += mkpacket(cap + n, 0x0B, 3, 1, 2, 3, 1);
+		n += mkpacket(cap + n, 0x0B, 4, 1, 2, 3, 1);
+
+		for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+			reset();
+			feed(cap, n, chunks[c]);
+			CHECK(updates[0] == 1 && updates[1] == 0);
+			CHECK(updates[2] == 1 && updates[3] == 1);
+			/* A lost byte leaves the framing intact, the CRC catches it */
+			CHECK(state.framing_errors + state.crc_errors >= 1);
+		}
+	}
+}
+
+/*
+ * Random line noise, heavy on start and escape bytes, between packets:
+ * nearly all of them must get through
+ */
+static void test_noise(void)
+{
+	unsigned int seed = 12345;
+	int i, k, n, packets;
+
+	reset();
+	for (n = 0, packets = 0, i = 0; i < 20000 && n < CAPTURE_SIZE - 100; i++) {
+		seed = seed * 1103515245 + 12345;
+		if ((seed >> 16) % 5 == 0) {
+			for (k = (seed >> 8) % 7; k > 0; k--) {
+				seed = seed * 1103515245 + 12345;
+				cap[n++] = ((seed >> 16) % 3) ? 0x7E - ((seed >> 20) & 1) : seed >> 16;
+			}
+		} else {
+			n += mkpacket(cap + n, 0x0B, 1 + (seed >> 16) % SENSORS,
+				seed & 0xFFFF, (seed >> 3) & 0xFFFF, 0x7E7E, 1);
+			packets++;
+		}
+	}
+	for (i = 0; i < n; i += k) {
+		seed = seed * 1103515245 + 12345;
+		k = min(1 + (int)((seed >> 16) % 97), n - i);
+		lunix_protocol_received_buf(&state, cap + i, k);
+	}
+
+	printf("noise: %d of %d packets received, %lu framing errors\n",
+		total_updates(), packets, state.framing_errors);
+	CHECK(total_updates() >= packets - packets / 100);
+	CHECK(state.framing_errors > 0);
+}
+
+/*
+ * Packets go to the decoder registered for their AM type, packets
+ * of other types are ignored
+ */
+static int health_packets, health_nodes;
+
+static void decode_health(struct lunix_protocol_state_struct *s)
+{
+	health_packets++;
+	health_nodes += uint16_from_packet(&s->packet[NODE_OFFSET]);
+}
+
+static const struct lunix_protocol_decoder health_decoder = {
+	.min_payload_length =	4,
+	.decode =		decode_health
+};
+
+static const struct lunix_protocol_decoder huge_decoder = {
+	.min_payload_length =	MAX_PACKET_LEN,
+	.decode =		decode_health
+};
+
+static void test_dispatch(void)
+{
+	int n;
+
+	reset();
+	CHECK(lunix_protocol_register(0x03, &health_decoder) == 0);
+	CHECK(lunix_protocol_register(0x03, &health_decoder) == -EBUSY);
+	CHECK(lunix_protocol_register(AM_TYPE_SENSOR_DATA, &health_decoder) == -EBUSY);
+	CHECK(lunix_protocol_register(0x04, &huge_decoder) == -EINVAL);
+
+	n = mkpacket(cap, 0x03, 5, 1, 2, 3, 1);
+	n += mkpacket(cap + n, 0x0B, 6, 1, 2, 3, 1);
+	n += mkpacket(cap + n, 0xFD, 7, 1, 2, 3, 1);
+	n += mkpacket(cap + n, 0x03, 8, 1, 2, 3, 1);
+	feed(cap, n, 3);
+
+	CHECK(health_packets == 2 && health_nodes == 5 + 8);
+	CHECK(total_updates() == 1 && updates[5] == 1);
+	CHECK(state.packets == 4 && state.framing_errors == 0);
+
+	/* Initialization starts over with the sensor data decoder only */
+	reset();
+	feed(cap, n, n);
+	CHECK(health_packets == 2 && updates[5] == 1);
+}
+
+int main(void)
+{
+	test_concatenated();
+	test_crc();
+	test_resync();
+	test_noise();
+	test_dispatch();
+
+	printf("%s\n", failures ? "FAILED" : "ok");
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}